@@ -15,9 +15,11 @@
  * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  *
- * compile with: gcc -rdynamic -no-pie `pkg-config --cflags gtk+-3.0` -o alsarecorder alsarecorder.c alsawrapper.c `pkg-config --libs gtk+-3.0` -lasound -lpthread -lm
+ * compile with: gcc -rdynamic -no-pie `pkg-config --cflags gtk+-3.0` -o alsarecorder alsarecorder.c alsawrapper.c `pkg-config --libs gtk+-3.0` -lasound -lmp3lame -lFLAC -lpthread -lm
 */
 
+#define _GNU_SOURCE
+
 #include "sys/time.h"
 #include "time.h"
 #include "signal.h"
@@ -25,6 +27,9 @@
 #include "stdint.h"
 #include "pwd.h"
 #include "unistd.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "stdatomic.h"
 
 #include "gtk/gtk.h"
 
@@ -39,60 +44,127 @@
 
 #define MAX_CHANNELS 32
 #define UPDATE_TIMER_INTERVAL 120 // in msec
-#define MAX_TOT_TIME 3600 // in sec
+#define MAX_TOT_TIME 86400 // in sec, RF64 lifts the 4 GiB wav limit
+#define MAX_PREROLL 300 // in sec
 #define SAVE_TO_WAV 0
 #define SAVE_TO_MP3 1
+#define SAVE_TO_FLAC 2
 #define VU_NORMAL 0
 #define VU_LOGARITHMIC 1
+#define EXPORT_THREADS 2
+#define EXPORT_CHUNK 1048576 // bytes copied between progress updates
+#define HOTPLUG_SETTLE 500 // msec between a card node appearing and listing the card
+#define MAX_EXTRA_DEVICES (AW_MAX_STREAMS - 1)
 
 static AwPcm* p_aw_pcm = NULL;
-static snd_pcm_t* p_pcm = NULL;
 static AwPcm aw_pcms[AW_MAX_PCMS_LENGTH];
 static uint8_t aw_pcms_length;
 static AwPcmParams aw_pcm_params;
 static uint8_t _nchannels;
 static uint32_t _framerate;
 static snd_pcm_format_t _format;
-static aw_record_state_t state = AW_STOPPED;
 static int defaultPcm = 0;
 static int saveFormat = SAVE_TO_WAV;
 static int vuFormat = VU_LOGARITHMIC;
-static AwComputeStruct ss;
 static char tmpname[64];
-static FILE* p_f = NULL;
-static aw_thread_struct_t thread_struct;
+static char tmppath[512];
+static gint ringDepth = AW_DEFAULT_RING_DEPTH;
+static gboolean noMmap = FALSE;
+static gint flacThreads = AW_FLAC_DEFAULT_THREADS;
+static gdouble preroll = AW_DEFAULT_PREROLL;
+static gint memoryBudget = 0; // MiB, 0 records straight to the tmp file
+static gboolean lockMemory = FALSE;
+static AwArena* p_arena = NULL;
+static gdouble rotateMinutes = 0;
+static gint rotateSize = 0; // MiB
+static uint32_t xrunsLogged = 0;
+static AwRtParams rt = { FALSE, AW_RT_DEFAULT_PRIORITY, -1 };
+static gchar* latency = NULL;
+static gboolean noDeviceCache = FALSE;
+static char deviceCachePath[256];
+static GMutex probeLocks[AW_MAX_PCMS_LENGTH]; // one per aw_pcms entry, held while it is probed
+static atomic_int probesPending; // cards still probed in background
+static int hotplugFd = -1;
+static gchar** extraDevices = NULL; // captured in the same session as the selected device
+static aw_latency_t latencyProfile = AW_LATENCY_BALANCED;
+static AwPcm* p_tuned_pcm = NULL; // auto latency is tuned again when device or framerate change, see arCaptureCommit
+static uint32_t tunedFramerate = 0;
 static struct timeval timeRef;
 static long long t1;
 static long long t2;
 static float totTime;
 static char cmd[1024];
-static int err;
-static int haveMp3Transcoder = 1;
 static char username[32];
 static char home[128];
 
-const unsigned char RIFF[4] = {'R','I','F','F'};
-const unsigned char WAVE[4] = {'W','A','V','E'};
-const unsigned char FMT_CHUNK_MARKER[4] = {'f','m','t',' '};
-const unsigned char DATA_CHUNK_HEADER[4] = {'d','a','t','a'};
-
-typedef struct WaveHeader {
-
-    unsigned char riff[4];
-    uint32_t overall_size;
-    unsigned char wave[4];
-    unsigned char fmt_chunk_marker[4];
-    uint32_t length_of_fmt;
-    uint16_t format_type;
-    uint16_t channels;
-    uint32_t sample_rate;
-    uint32_t byterate;
-    uint16_t block_align;
-    uint16_t bits_per_sample;
-    unsigned char data_chunk_header[4];
-    uint32_t data_size;
-
-} WaveHeader;
+/* a finished take on its way from the tmp folder to the user's choice, moved off the gtk thread */
+typedef struct ArExportJob {
+
+    char src[512];
+    char dst[512];
+    char name[96];
+    AwArena* p_arena; // in memory take, NULL when it is the src file
+    GtkWidget* window;
+    GtkProgressBar* progressBar;
+    atomic_int progress; // per mille
+    atomic_int cancel;
+    atomic_int done; // 1 saved, -1 failed or canceled
+    int err;
+
+} ArExportJob;
+
+static GThreadPool* exportPool = NULL;
+
+/* a device captured along with the selected one, recorded into its own files */
+typedef struct ArExtraStream {
+
+    char name[32];
+    AwPcmParams params;
+    snd_pcm_t* p_pcm;
+    AwWriter writer;
+    AwComputeStruct ss;
+    FILE* p_f;
+    char path[512];
+    uint32_t xruns_logged;
+
+} ArExtraStream;
+
+/* a running capture: device and options it was opened with, its writer, meters and thread */
+typedef struct ArCapture {
+
+    AwPcm* p_aw_pcm;
+    int default_pcm; // opened through plughw
+    AwPcmParams params;
+    uint8_t hw_nchannels; // hw options kept while plughw is used
+    uint32_t hw_framerate;
+    snd_pcm_format_t hw_format;
+    AwPcm* p_tuned_pcm; // the auto latency in params was tuned for this device and framerate
+    uint32_t tuned_framerate;
+    snd_pcm_t* p_pcm;
+    AwWriter writer;
+    AwComputeStruct ss;
+    FILE* p_f; // the take, its writer follows this pointer
+    aw_thread_struct_t thread_struct;
+    aw_atomic_state_t state;
+    pthread_t thread_id;
+    int err;
+    int nextras;
+    ArExtraStream extras[MAX_EXTRA_DEVICES];
+    AwStream streams[AW_MAX_STREAMS]; // the selected device first, serviced by one poll loop
+
+} ArCapture;
+
+/* a switch in progress, see arPcmSwitch */
+typedef struct ArSwitch {
+
+    ArCapture* p_new;
+    ArCapture* p_old; // stopped by the switch thread when the new capture finds its device busy
+    ArCapture* p_back; // the old options reopened when the new ones fail after that stop
+
+} ArSwitch;
+
+static ArCapture* p_capture = NULL; // the one metered and recorded
+static ArCapture* p_pending = NULL; // opening in background, see arPcmSwitch
 
 typedef struct Gui {
 
@@ -123,6 +195,8 @@ typedef struct Gui {
 
 Gui* GUI;
 
+int arUpdatePcmOptionsPanel (); // redrawn by every switch, defined with the option handlers
+
 
 /*============================================================================
 				functions and gui controllers
@@ -139,177 +213,443 @@ int arQuit (GtkWidget* widget)
     arQuit_ ();
 }
 
+const char* arSaveExtension ()
+{
+    return aw_save_extension ((*p_capture).writer.format);
+}
+
+int arRotating ()
+{
+    return rotateMinutes > 0 || rotateSize > 0;
+}
+
 int arOpenTempFile ()
 {
     static time_t t;
     struct tm* timeinfo;
-    char tmppath[512];
+
+    // the writer encodes the whole take in the format chosen now
+    if (saveFormat == SAVE_TO_MP3)
+    {
+        (*p_capture).writer.format = AW_SAVE_MP3;
+
+    } else if (saveFormat == SAVE_TO_FLAC && aw_pcm_params.nchannels <= AW_FLAC_MAX_CHANNELS) {
+
+        (*p_capture).writer.format = AW_SAVE_FLAC;
+        (*p_capture).writer.flac_threads = flacThreads;
+
+    } else {
+
+        if (saveFormat == SAVE_TO_FLAC)
+            printf ("flac holds at most %d channels: recording in wav\n", AW_FLAC_MAX_CHANNELS);
+        (*p_capture).writer.format = AW_SAVE_WAV;
+    }
 
     time (&t);
     timeinfo = localtime (&t);
     strftime (tmpname, sizeof tmpname, "rec-%Y-%m-%d-%H-%M-%S", timeinfo);
-    snprintf (tmppath, sizeof tmppath, "%s/.alsarecorder/tmp/%s", home, tmpname);
+    snprintf (tmppath, sizeof tmppath, "%s/.alsarecorder/tmp/%s.%s", home, tmpname, arSaveExtension ());
+
+    // continuous recording: segments go straight to the recordings folder, the writer opens the next ones
+    (*p_capture).writer.rotate_frames = rotateMinutes * 60 * aw_pcm_params.framerate;
+    (*p_capture).writer.rotate_bytes = (uint64_t) rotateSize << 20;
+
+    if (arRotating ())
+    {
+        snprintf ((*p_capture).writer.rotate_prefix, sizeof (*p_capture).writer.rotate_prefix, "%s/Recordings/%s", home, tmpname);
+        aw_segment_path (tmppath, sizeof tmppath, (*p_capture).writer.rotate_prefix, 1, (*p_capture).writer.format);
+
+        if (((*p_capture).p_f = fopen (tmppath, "wb")) == NULL)
+            return -1;
+
+        return 0;
+    }
     
-    if ((p_f = fopen (tmppath, "wb")) == NULL)
+    // in memory takes spill to tmppath only past the budget
+    if (memoryBudget > 0)
+    {
+        if ((p_arena = malloc (sizeof (AwArena))) == NULL)
+            return -1;
+
+        if (((*p_capture).p_f = aw_arena_open (p_arena, (size_t) memoryBudget << 20, lockMemory, tmppath)) == NULL)
+        {
+            free (p_arena);
+            p_arena = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if (((*p_capture).p_f = fopen (tmppath, "wb")) == NULL)
         return -1;
 
     return 0;
 }
 
-int arCloseTempFile ()
-{    
-    if ((fclose (p_f)) == EOF)
-        return -1;    
+/* extra devices record straight to the recordings folder, named after the take and the device */
+int arOpenExtraFiles ()
+{
+    ArExtraStream* p_extra;
+    char device[32];
+    int i;
+    int j;
+
+    for (i = 0; i < (*p_capture).nextras; i++)
+    {
+        p_extra = &(*p_capture).extras[i];
 
+        if (saveFormat == SAVE_TO_MP3)
+        {
+            (*p_extra).writer.format = AW_SAVE_MP3;
+
+        } else if (saveFormat == SAVE_TO_FLAC && (*p_extra).params.nchannels <= AW_FLAC_MAX_CHANNELS) {
+
+            (*p_extra).writer.format = AW_SAVE_FLAC;
+            (*p_extra).writer.flac_threads = flacThreads;
+
+        } else {
+
+            (*p_extra).writer.format = AW_SAVE_WAV;
+        }
+        (*p_extra).writer.rotate_frames = (*p_capture).writer.rotate_frames;
+        (*p_extra).writer.rotate_bytes = (*p_capture).writer.rotate_bytes;
+
+        // hw:1,0 becomes hw-1-0
+        snprintf (device, sizeof device, "%s", (*p_extra).name);
+
+        for (j = 0; device[j] != '\0'; j++)
+            if (device[j] == ':' || device[j] == ',' || device[j] == '/')
+                device[j] = '-';
+
+        snprintf ((*p_extra).writer.rotate_prefix, sizeof (*p_extra).writer.rotate_prefix, "%s/Recordings/%s-%s", home, tmpname, device);
+
+        if (arRotating ())
+            aw_segment_path ((*p_extra).path, sizeof (*p_extra).path, (*p_extra).writer.rotate_prefix, 1, (*p_extra).writer.format);
+        else
+            snprintf ((*p_extra).path, sizeof (*p_extra).path, "%s.%s", (*p_extra).writer.rotate_prefix, aw_save_extension ((*p_extra).writer.format));
+
+        if (((*p_extra).p_f = fopen ((*p_extra).path, "wb")) == NULL)
+        {
+            while (i-- > 0)
+                fclose ((*p_capture).extras[i].p_f);
+            return -1;
+        }
+    }
     return 0;
 }
 
-int arSave ()
-{   
-    char recfolder[512];
-    char tmppath[512];
-    char wavpath[512];
-    char mp3path[512];
-    char userpath[512];
-    FILE* p_tmpf;
-    FILE* p_wavf;
-    long dataSize;
-    long fileSize;
-    char buffer[1024];
-    uint32_t bytesNum = 0;
-    const unsigned int HEADERS_SIZE = 44;
-    WaveHeader wh;
-    GtkWidget* dialog;
-    GtkFileChooser* chooser;
-    gint response;
-    
-    dialog = gtk_file_chooser_dialog_new ("Save Recording",
-                                          NULL,
-                                          GTK_FILE_CHOOSER_ACTION_SAVE,
-                                          "_Cancel",
-                                          GTK_RESPONSE_CANCEL,
-                                          "_Save",
-                                          GTK_RESPONSE_ACCEPT,
-                                          NULL);
-    
-    chooser = GTK_FILE_CHOOSER (dialog);
+/* each extra take is reported with its start against the one of the selected device, for aligning the files */
+int arCloseExtraFiles ()
+{
+    ArExtraStream* p_extra;
+    struct tm* timeinfo;
+    char when[32];
+    double offset;
+    int i;
 
-    gtk_file_chooser_set_do_overwrite_confirmation (chooser, TRUE);
+    if ((*p_capture).nextras == 0)
+        return 0;
 
-    // get paths
-    snprintf (tmppath, sizeof tmppath, "%s/.alsarecorder/tmp/%s", home, tmpname);
-    snprintf (recfolder, sizeof recfolder, "%s/Recordings", home);
+    timeinfo = localtime (&(*p_capture).ss.take_start.tv_sec);
+    strftime (when, sizeof when, "%Y-%m-%d %H:%M:%S", timeinfo);
+    printf ("%s: take starts at %s.%09ld\n", (*p_aw_pcm).name, when, (*p_capture).ss.take_start.tv_nsec);
 
-    if (saveFormat == SAVE_TO_WAV)
+    for (i = 0; i < (*p_capture).nextras; i++)
     {
-        snprintf (wavpath, sizeof wavpath, "%s.wav", tmpname);
-        gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (dialog), wavpath);
+        p_extra = &(*p_capture).extras[i];
 
-    } else {
+        if (aw_writer_wait_end (&(*p_extra).writer) < 0)
+            printf ("%s: recording may be truncated\n", (*p_extra).name);
+
+        if (fclose ((*p_extra).p_f) == EOF)
+            printf ("%s: error closing %s\n", (*p_extra).name, (*p_extra).path);
+
+        offset = ((*p_extra).ss.take_start.tv_sec - (*p_capture).ss.take_start.tv_sec) * 1000.0 +
+                 ((*p_extra).ss.take_start.tv_nsec - (*p_capture).ss.take_start.tv_nsec) / 1e6;
 
-        snprintf (wavpath, sizeof wavpath, "%s/.alsarecorder/tmp/%s.wav", home, tmpname);
-        snprintf (mp3path, sizeof mp3path, "%s.mp3", tmpname);
-        gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (dialog), mp3path);
+        if (arRotating ())
+            printf ("%s: recorded in segments %s-NNN.%s, starting %+.3f ms from %s\n", (*p_extra).name, (*p_extra).writer.rotate_prefix,
+                    aw_save_extension ((*p_extra).writer.format), offset, (*p_aw_pcm).name);
+        else
+            printf ("%s: recorded in %s, starting %+.3f ms from %s\n", (*p_extra).name, (*p_extra).path, offset, (*p_aw_pcm).name);
     }
-    gtk_file_chooser_set_current_folder (GTK_FILE_CHOOSER (dialog), recfolder);
+    return 0;
+}
 
-    response = gtk_dialog_run (GTK_DIALOG (dialog));
+int arCloseTempFile ()
+{    
+    if ((fclose ((*p_capture).p_f)) == EOF)
+        return -1;    
+
+    return 0;
+}
 
-    if (response == GTK_RESPONSE_ACCEPT)
+int arMoveFile (const char* src, const char* dst, atomic_int* p_progress, atomic_int* p_cancel)
+{
+    int fd_in;
+    int fd_out;
+    int use_copy_file_range = 1;
+    struct stat st;
+    off_t copied = 0;
+    ssize_t n = 0;
+    char buffer[65536];
+
+    // same filesystem: just a rename
+    if (rename (src, dst) == 0)
     {
-        snprintf (userpath, sizeof userpath, "%s", gtk_file_chooser_get_filename (chooser));
-        gtk_widget_destroy (dialog);
-        
-    } else {
+        atomic_store (p_progress, 1000);
+        return 0;
+    }
+    if (errno != EXDEV)
+        return -1;
 
-        if (remove (tmppath) != 0)
-            printf ("Error in removing tmp recordings.");
-        gtk_widget_destroy (dialog);
+    // other filesystem: in-kernel copy in chunks, plain read/write if not supported
+    if ((fd_in = open (src, O_RDONLY)) < 0)
+        return -1;
 
+    if (fstat (fd_in, &st) < 0 || (fd_out = open (dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        close (fd_in);
         return -1;
-    }        
-    
-    // open
-    if ((p_tmpf = fopen (tmppath, "rb")) == NULL)
+    }
+    while (copied < st.st_size)
+    {
+        if (atomic_load (p_cancel))
+        {
+            errno = ECANCELED;
+            n = -1;
+            break;
+        }
+        if (use_copy_file_range)
+        {
+            n = copy_file_range (fd_in, NULL, fd_out, NULL, EXPORT_CHUNK, 0);
+
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL))
+            {
+                use_copy_file_range = 0;
+                continue;
+            }
+        } else {
+
+            if ((n = read (fd_in, buffer, sizeof buffer)) > 0 && write (fd_out, buffer, n) != n)
+                n = -1;
+        }
+        if (n <= 0) break;
+
+        copied += n;
+        atomic_store (p_progress, copied * 1000 / st.st_size);
+    }
+    // the source ended before its size: a short copy, not a move
+    if (n == 0 && copied < st.st_size)
+    {
+        errno = EIO;
+        n = -1;
+    }
+    close (fd_in);
+
+    if (close (fd_out) < 0 || n < 0)
+    {
+        // keep the tmp take, drop the partial copy
+        n = errno;
+        remove (dst);
+        errno = n;
         return -1;
+    }
+
+    return remove (src);
+}
+
+void arExportJob (gpointer p_job_, gpointer data)
+{
+    ArExportJob* p_job = (ArExportJob*) p_job_;
+    int result;
 
-    if (saveFormat == SAVE_TO_WAV)
+    if ((*p_job).p_arena != NULL && !aw_arena_spilled ((*p_job).p_arena))
     {
-        if ((p_wavf = fopen (userpath, "wb")) == NULL)
-            return -1;
+        // a take that only lived in memory is kept in the tmp folder on failure
+        if ((result = aw_arena_save ((*p_job).p_arena, (*p_job).dst, &(*p_job).progress, &(*p_job).cancel)) != 0)
+        {
+            (*p_job).err = errno;
+            aw_arena_save ((*p_job).p_arena, (*p_job).src, NULL, NULL);
+        }
 
     } else {
 
-        if ((p_wavf = fopen (wavpath, "wb")) == NULL)
-            return -1;
+        if ((result = arMoveFile ((*p_job).src, (*p_job).dst, &(*p_job).progress, &(*p_job).cancel)) != 0)
+            (*p_job).err = errno;
     }
+    if ((*p_job).p_arena != NULL)
+    {
+        aw_arena_free ((*p_job).p_arena);
+        free ((*p_job).p_arena);
+        (*p_job).p_arena = NULL;
+    }
+    if (result == 0)
+        atomic_store (&(*p_job).progress, 1000);
+
+    atomic_store (&(*p_job).done, result == 0 ? 1 : -1);
+}
+
+int arCancelExport (GtkButton* button, ArExportJob* p_job)
+{
+    atomic_store (&(*p_job).cancel, 1);
+    gtk_widget_set_sensitive (GTK_WIDGET (button), FALSE);
+}
+
+gboolean arCloseExport (GtkWidget* widget, GdkEvent* event, ArExportJob* p_job)
+{
+    // the window goes away with the job
+    atomic_store (&(*p_job).cancel, 1);
+
+    return TRUE;
+}
+
+gboolean arUpdateExport (gpointer p_job_)
+{
+    ArExportJob* p_job = (ArExportJob*) p_job_;
+    int done = atomic_load (&(*p_job).done);
+
+    gtk_progress_bar_set_fraction ((*p_job).progressBar, atomic_load (&(*p_job).progress) / 1000.0);
+
+    if (done == 0)
+        return G_SOURCE_CONTINUE;
+
+    if (done < 0)
+        printf ("error in saving recording: %s, take kept in %s\n", strerror ((*p_job).err), (*p_job).src);
+
+    gtk_widget_destroy ((*p_job).window);
+    free (p_job);
+
+    return G_SOURCE_REMOVE;
+}
+
+int arStartExport (ArExportJob* p_job)
+{
+    GtkWidget* box;
+    GtkWidget* button;
+
+    // small progress window per job, closing it cancels
+    (*p_job).window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title (GTK_WINDOW ((*p_job).window), "Saving Recording");
+    gtk_window_set_transient_for (GTK_WINDOW ((*p_job).window), GTK_WINDOW (GUI->main));
+
+    box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 6);
+    gtk_container_set_border_width (GTK_CONTAINER (box), 12);
+    gtk_container_add (GTK_CONTAINER ((*p_job).window), box);
+
+    gtk_box_pack_start (GTK_BOX (box), gtk_label_new ((*p_job).name), FALSE, FALSE, 0);
 
-    fseek (p_tmpf, 0L, SEEK_END);
-    dataSize = ftell (p_tmpf);
-    fseek (p_tmpf, 0L, SEEK_SET);
+    (*p_job).progressBar = GTK_PROGRESS_BAR (gtk_progress_bar_new ());
+    gtk_box_pack_start (GTK_BOX (box), GTK_WIDGET ((*p_job).progressBar), FALSE, FALSE, 0);
 
-    fileSize = dataSize + HEADERS_SIZE;
+    button = gtk_button_new_with_label ("Cancel");
+    gtk_box_pack_start (GTK_BOX (box), button, FALSE, FALSE, 0);
 
-    memcpy (wh.riff, RIFF, 4);
-    wh.overall_size = fileSize - 8;
-    memcpy (wh.wave, WAVE, 4);
-    memcpy (wh.fmt_chunk_marker, FMT_CHUNK_MARKER, 4);
-    wh.length_of_fmt = 16;
-    wh.format_type = 1;
-    wh.channels = aw_pcm_params.nchannels;
-    wh.sample_rate = aw_pcm_params.framerate;
-    wh.byterate = aw_pcm_params.byterate;
-    wh.block_align = aw_pcm_params.framesize;
-    wh.bits_per_sample = aw_pcm_params.real_bits;
-    memcpy (wh.data_chunk_header, DATA_CHUNK_HEADER, 4);
-    wh.data_size = dataSize;
+    g_signal_connect (button, "clicked", G_CALLBACK (arCancelExport), p_job);
+    g_signal_connect ((*p_job).window, "delete-event", G_CALLBACK (arCloseExport), p_job);
 
-    fwrite (&wh, sizeof wh, 1, p_wavf);
+    gtk_widget_show_all ((*p_job).window);
+
+    g_timeout_add (UPDATE_TIMER_INTERVAL, (GSourceFunc) arUpdateExport, p_job);
+    g_thread_pool_push (exportPool, p_job, NULL);
+
+    return 0;
+}
 
-    // read and write rest    
-    while (bytesNum >= 0 && !feof (p_tmpf))
+int arSaveResponse (GtkDialog* dialog, gint response, ArExportJob* p_job)
+{
+    gchar* filename;
+
+    if (response == GTK_RESPONSE_ACCEPT && (filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog))) != NULL)
     {
-        bytesNum = fread (buffer, 1, 1024, p_tmpf);
-        fwrite (buffer, 1, bytesNum, p_wavf);
+        snprintf ((*p_job).dst, sizeof (*p_job).dst, "%s", filename);
+        g_free (filename);
+        gtk_widget_destroy (GTK_WIDGET (dialog));
+
+        return arStartExport (p_job);
     }
+    if ((*p_job).p_arena != NULL)
+    {
+        aw_arena_free ((*p_job).p_arena);
 
-    // close
-    if ((fclose (p_tmpf)) == EOF)
-        return -1;
-    if ((fclose (p_wavf)) == EOF)
-        return -1;
+        if (!aw_arena_spilled ((*p_job).p_arena))
+            (*p_job).src[0] = '\0';
+
+        free ((*p_job).p_arena);
+    }
+    if ((*p_job).src[0] != '\0' && remove ((*p_job).src) != 0)
+        printf ("Error in removing tmp recordings.");
 
-    // remove tmp file  
-    if (remove (tmppath) != 0)
+    gtk_widget_destroy (GTK_WIDGET (dialog));
+    free (p_job);
+
+    return -1;
+}
+
+int arSave ()
+{   
+    char recfolder[512];
+    GtkWidget* dialog;
+    GtkFileChooser* chooser;
+    ArExportJob* p_job;
+
+    // the job owns its paths, so the next take can start while this one is saved
+    if ((p_job = calloc (1, sizeof (ArExportJob))) == NULL)
         return -1;
 
-    // transcode in mp3
-    if (saveFormat == SAVE_TO_MP3)
-    {
-        if (system (NULL))
-        {
-            snprintf (cmd, sizeof cmd, "ffmpeg -i \"%s\" -codec:a libmp3lame -qscale:a 2 \"%s\"", wavpath, userpath);
-            if (system (cmd) != 0)
-                printf ("error in mp3 transcoding");
-        }
-        // remove tmp file  
-        if (remove (wavpath) != 0)
-            return -1;
-    }
+    snprintf ((*p_job).src, sizeof (*p_job).src, "%s", tmppath);
+    (*p_job).p_arena = p_arena;
+    p_arena = NULL;
+    snprintf ((*p_job).name, sizeof (*p_job).name, "%s.%s", tmpname, arSaveExtension ());
+
+    dialog = gtk_file_chooser_dialog_new ("Save Recording",
+                                          GTK_WINDOW (GUI->main),
+                                          GTK_FILE_CHOOSER_ACTION_SAVE,
+                                          "_Cancel",
+                                          GTK_RESPONSE_CANCEL,
+                                          "_Save",
+                                          GTK_RESPONSE_ACCEPT,
+                                          NULL);
+    
+    chooser = GTK_FILE_CHOOSER (dialog);
+
+    gtk_file_chooser_set_do_overwrite_confirmation (chooser, TRUE);
+
+    // get paths
+    snprintf (recfolder, sizeof recfolder, "%s/Recordings", home);
+    gtk_file_chooser_set_current_name (chooser, (*p_job).name);
+    gtk_file_chooser_set_current_folder (chooser, recfolder);
+
+    // not modal: meters and the next take keep running
+    g_signal_connect (dialog, "response", G_CALLBACK (arSaveResponse), p_job);
+    gtk_widget_show (dialog);
+
     return 0;
 }
 
 int arRecordStop_ ()
 {
-    if (state == AW_RECORDING || state == AW_PAUSED)
+    if (p_capture == NULL) return 0;
+
+    if ((*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED)
     {
-        state = AW_MONITORING;
+        (*p_capture).state = AW_MONITORING;
         
         gtk_button_set_image (GUI->recordstopButton, gtk_image_new_from_file ("media/record_noactive.png"));
         gtk_button_set_image (GUI->pauseButton, gtk_image_new_from_file ("media/pause_noactive.png"));
         
+        if (aw_writer_wait_end (&(*p_capture).writer) < 0)
+            printf ("recording may be truncated\n");
+
+        printf ("ring high water %d/%d, overflows %d\n", (*p_capture).ss.ring_high_water, ringDepth, (*p_capture).ss.ring_overflows);
+        printf ("xruns %u, short reads %u, frames lost %lu in this session\n", (*p_capture).ss.xruns, (*p_capture).ss.short_reads, (*p_capture).ss.lost_frames);
+
+        arCloseExtraFiles ();
         arCloseTempFile ();        
-        arSave ();
+
+        if (arRotating ())
+            printf ("recording saved in segments %s-NNN.%s\n", (*p_capture).writer.rotate_prefix, arSaveExtension ());
+        else
+            arSave ();
 
         gtk_label_set_text (GUI->timeLabel, "0.00");
 
@@ -318,14 +658,28 @@ int arRecordStop_ ()
         gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), TRUE);
         gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), TRUE);
 
-    } else if (state == AW_MONITORING) {
+    } else if ((*p_capture).state == AW_MONITORING) {
 
         if (arOpenTempFile () < 0) {
 
             printf ("error in open tmp recording file\n\n");
             return -1;
         }
-        
+
+        if (arOpenExtraFiles () < 0) {
+
+            arCloseTempFile ();
+            if (p_arena != NULL)
+            {
+                aw_arena_free (p_arena);
+                free (p_arena);
+                p_arena = NULL;
+            }
+            remove (tmppath);
+            printf ("error in open extra device recording files\n\n");
+            return -1;
+        }
+
         gtk_widget_set_sensitive (GTK_WIDGET (GUI->deviceOptionsButtonBox), FALSE);
         gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), FALSE);
         gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), FALSE);
@@ -333,7 +687,7 @@ int arRecordStop_ ()
         
         gtk_button_set_image (GUI->recordstopButton, gtk_image_new_from_file ("media/record_active.png"));
         
-        state = AW_RECORDING;
+        (*p_capture).state = AW_RECORDING;
         
         gettimeofday (&timeRef, NULL);
         totTime = 0;
@@ -348,58 +702,137 @@ int arRecordStop (GtkButton* button)
 
 int arPause (GtkButton* button)
 {
-    if (state == AW_PAUSED)
+    if (p_capture == NULL) return 0;
+
+    if ((*p_capture).state == AW_PAUSED)
     {
-        state = AW_RECORDING;
+        (*p_capture).state = AW_RECORDING;
         gtk_button_set_image (GUI->pauseButton, gtk_image_new_from_file ("media/pause_noactive.png"));
 
         gettimeofday (&timeRef, NULL);
         totTime = totTime + ((float) (t2 - t1)) / 1000.0;
         t1 = (long long) timeRef.tv_sec * 1000L + timeRef.tv_usec / 1000;
 
-    } else if (state == AW_RECORDING) {
+    } else if ((*p_capture).state == AW_RECORDING) {
 
         gtk_button_set_image (GUI->pauseButton, gtk_image_new_from_file ("media/pause_active.png"));
-        state = AW_PAUSED;
+        (*p_capture).state = AW_PAUSED;
     }   
 }
 
+int arLogStreamXruns (AwComputeStruct* p_ss, uint32_t* p_logged, uint32_t framerate, const char* device)
+{
+    AwXrun* p_xrun;
+    struct tm* timeinfo;
+    char when[32];
+
+    // entries older than the log length are gone, only their count remains
+    if ((*p_ss).xruns - *p_logged > AW_XRUN_LOG_LENGTH)
+        *p_logged = (*p_ss).xruns - AW_XRUN_LOG_LENGTH;
+
+    for (; *p_logged != (*p_ss).xruns; (*p_logged)++)
+    {
+        p_xrun = &(*p_ss).xrun_log[*p_logged % AW_XRUN_LOG_LENGTH];
+        timeinfo = localtime (&(*p_xrun).when.tv_sec);
+        strftime (when, sizeof when, "%Y-%m-%d %H:%M:%S", timeinfo);
+
+        printf ("xrun on %s at %s.%03ld: %lu frames lost (%.1f ms)%s\n", device, when, (*p_xrun).when.tv_nsec / 1000000, (*p_xrun).lost_frames,
+                (*p_xrun).lost_frames * 1000.0 / framerate, (*p_capture).state == AW_RECORDING ? ", filled with silence" : "");
+    }
+    return 0;
+}
+
+int arLogXruns ()
+{
+    int i;
+
+    arLogStreamXruns (&(*p_capture).ss, &xrunsLogged, aw_pcm_params.framerate, (*p_aw_pcm).name);
+
+    for (i = 0; i < (*p_capture).nextras; i++)
+        arLogStreamXruns (&(*p_capture).extras[i].ss, &(*p_capture).extras[i].xruns_logged, (*p_capture).extras[i].params.framerate, (*p_capture).extras[i].name);
+
+    return 0;
+}
+
+/* meters run over the channels of the selected device, then over those of each extra device */
+int arMeterCount ()
+{
+    int count = aw_pcm_params.nchannels;
+    int i;
+
+    for (i = 0; i < (*p_capture).nextras; i++)
+        count += (*p_capture).extras[i].params.nchannels;
+
+    return count < MAX_CHANNELS ? count : MAX_CHANNELS;
+}
+
+AwComputeStruct* arMeterSource (int meter, int* p_channel, int* p_stream)
+{
+    int i;
+
+    *p_stream = 0;
+    *p_channel = meter;
+
+    if (meter < aw_pcm_params.nchannels)
+        return &(*p_capture).ss;
+
+    *p_channel -= aw_pcm_params.nchannels;
+
+    for (i = 0; i < (*p_capture).nextras; i++)
+    {
+        *p_stream = i + 1;
+
+        if (*p_channel < (*p_capture).extras[i].params.nchannels)
+            return &(*p_capture).extras[i].ss;
+
+        *p_channel -= (*p_capture).extras[i].params.nchannels;
+    }
+    return NULL;
+}
+
 gboolean arUpdateStatsAndVUMeters (gpointer data)
 {
+    AwComputeStruct* p_ss;
     int i;
-    char value[16];
+    int channel;
+    int stream;
+    char value[32];
     float level;
     float time;
     unsigned int int_part;
     unsigned int dec_part;
 
-    for (i = 0; i < aw_pcm_params.nchannels; i++)
+    for (i = 0; i < arMeterCount (); i++)
     {
+        p_ss = arMeterSource (i, &channel, &stream);
+
         if (vuFormat == VU_LOGARITHMIC)
         {
-            level = ss.avg_log[i];
+            level = (*p_ss).avg_log[channel];
 
         } else {
             
-            level = ss.avg_power[i];
+            level = (*p_ss).avg_power[channel];
         }        
         if (level == 0) level = 1;
         
         gtk_level_bar_set_value (GUI->vuGraphicMeters[i], level);
         
-        if (ss.clip[i])
+        if ((*p_ss).clip[channel])
         {
             gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (GUI->vuNumericMeters[i])), "vu-numeric-meter-clipped");
             gtk_button_set_label (GUI->vuNumericMeters[i], "clip");
 
         } else {
 
-            snprintf (value, sizeof value, "%d", (uint8_t) ss.max[i]);
+            snprintf (value, sizeof value, "%d", (uint8_t) (*p_ss).max[channel]);
             gtk_button_set_label (GUI->vuNumericMeters[i], value);
         }        
     }
 
-    if (state == AW_RECORDING)
+    arLogXruns ();
+
+    if ((*p_capture).state == AW_RECORDING)
     {
         gettimeofday (&timeRef, NULL);
         t2 = (long long) timeRef.tv_sec * 1000L + timeRef.tv_usec / 1000;
@@ -408,22 +841,18 @@ gboolean arUpdateStatsAndVUMeters (gpointer data)
         int_part = (unsigned int) time;
         dec_part = (unsigned int) ((time - int_part) * 100);
 
-        snprintf (value, sizeof value, "%d.%02d", int_part, dec_part);
+        if ((*p_capture).ss.xruns > 0)
+            snprintf (value, sizeof value, "%d.%02d  xruns %u", int_part, dec_part, (*p_capture).ss.xruns);
+        else
+            snprintf (value, sizeof value, "%d.%02d", int_part, dec_part);
 
         gtk_label_set_text (GUI->timeLabel, value);
         
-        if (totTime > MAX_TOT_TIME) arRecordStop_();
+        if (totTime > MAX_TOT_TIME && !arRotating ()) arRecordStop_();
     }
 
-    // check if continue callback
-    if (state == AW_MONITORING || state == AW_RECORDING || state == AW_PAUSED)
-    {
-        return TRUE;
-
-    } else {
-
-        return FALSE;
-    }
+    // runs for the whole session, captures are switched under it
+    return TRUE;
 }
 
 int arAbout ()
@@ -456,14 +885,54 @@ int arAbout ()
     gtk_widget_show_all (dialog);
 }
 
+/* a device is probed once, by its card thread or by the gui when selected first */
+int arProbePcm (AwPcm* p_aw_pcm_)
+{
+    GMutex* p_lock = &probeLocks[p_aw_pcm_ - aw_pcms];
+
+    g_mutex_lock (p_lock);
+
+    if (!(*p_aw_pcm_).probed)
+        aw_probe_pcm (p_aw_pcm_);
+
+    g_mutex_unlock (p_lock);
+
+    return 0;
+}
+
+/* background probe of a card listed without capabilities, the last one refreshes the cache */
+gpointer arProbeCard (gpointer p_card)
+{
+    int i;
+
+    for (i = 0; i < aw_pcms_length; i++)
+    {
+        // entries may be reassigned by hotplug, the card is checked under the lock
+        g_mutex_lock (&probeLocks[i]);
+
+        if (aw_pcms[i].card == GPOINTER_TO_INT (p_card) && !aw_pcms[i].probed)
+            aw_probe_pcm (&aw_pcms[i]);
+
+        g_mutex_unlock (&probeLocks[i]);
+    }
+    if (atomic_fetch_sub (&probesPending, 1) == 1 && !noDeviceCache)
+        aw_save_pcm_devices_cache (aw_pcms, aw_pcms_length, deviceCachePath);
+
+    return NULL;
+}
+
 int arGetPcmDevices ()
 {
     int i;
-    int j;
+    int cards[AW_MAX_CARDS];
+    int ncards = 0;
     uint8_t all_aw_pcms_length;
     AwPcm all_aw_pcms[AW_MAX_PCMS_LENGTH];
 
-    aw_get_pcm_devices (all_aw_pcms, &all_aw_pcms_length);
+    snprintf (deviceCachePath, sizeof deviceCachePath, "%s/.alsarecorder/devices.cache", home);
+
+    /* only card and device names here, capabilities come from the cache or are probed later */
+    aw_get_pcm_devices_cached (all_aw_pcms, &all_aw_pcms_length, noDeviceCache ? NULL : deviceCachePath, 1);
     
     aw_pcms_length = 0;
     for (i = 0; i < all_aw_pcms_length; i++)
@@ -474,6 +943,18 @@ int arGetPcmDevices ()
             aw_pcms_length++;
         }
     }
+
+    /* one thread per card still to probe, all counted before any starts */
+    for (i = 0; i < aw_pcms_length; i++)
+    {
+        if (!aw_pcms[i].probed && (i == 0 || aw_pcms[i - 1].card != aw_pcms[i].card))
+            cards[ncards++] = aw_pcms[i].card;
+    }
+    atomic_init (&probesPending, ncards);
+
+    for (i = 0; i < ncards; i++)
+        g_thread_unref (g_thread_new ("probe", arProbeCard, GINT_TO_POINTER (cards[i])));
+
     return 0;
 }
 
@@ -485,12 +966,16 @@ int arGetPcmDevice (AwPcm** p_p_aw_pcm)
 
 int arResetNumericMeter (GtkButton* button)
 {
+    AwComputeStruct* p_ss;
+    int channel;
+    int stream;
     int i = atoi (gtk_widget_get_name ( GTK_WIDGET (button)));
 
     gtk_style_context_remove_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "vu-numeric-meter-clipped");
     gtk_button_set_label (button, "0");
-    ss.clip[i] = 0; // TODO
-    ss.max[i] = 0; // TODO
+    p_ss = arMeterSource (i, &channel, &stream);
+    (*p_ss).clip[channel] = 0; // TODO
+    (*p_ss).max[channel] = 0; // TODO
 }
 
 int arDrawVUMeters ()
@@ -501,7 +986,9 @@ int arDrawVUMeters ()
     GtkButton* button;
     GtkLabel* label;
     int i;
-    char ch[8];    
+    int channel;
+    int stream;
+    char ch[16];    
     char val[8];    
     
     /* clean panel */
@@ -518,126 +1005,566 @@ int arDrawVUMeters ()
     for (iter=children; iter != NULL; iter = g_list_next (iter))
         gtk_widget_destroy (GTK_WIDGET (iter->data));
 
-    g_list_free (children);
+    g_list_free (children);
+
+    children = gtk_container_get_children (GTK_CONTAINER (GUI->vuLabelsBox));
+
+    for (iter=children; iter != NULL; iter = g_list_next (iter)) 
+        gtk_widget_destroy (GTK_WIDGET (iter->data));
+
+    g_list_free (children);
+
+    /* draw vu meters (graphic, buttons, labels) */  
+    
+    for (i = 0; i < arMeterCount (); i++)
+    {
+        arMeterSource (i, &channel, &stream);
+        snprintf (val, sizeof val, "%d", i);
+
+        if (stream == 0)
+            snprintf (ch, sizeof ch, "ch %d", channel);
+        else
+            snprintf (ch, sizeof ch, "%d:ch %d", stream, channel);
+
+        /* graphic */
+        bar = GTK_LEVEL_BAR (gtk_level_bar_new_for_interval (0, 100));
+        gtk_level_bar_set_value (bar, 70);
+        gtk_level_bar_set_inverted (bar, TRUE);
+        gtk_orientable_set_orientation (GTK_ORIENTABLE (bar), GTK_ORIENTATION_VERTICAL);
+        gtk_level_bar_set_mode (bar, GTK_LEVEL_BAR_MODE_DISCRETE);
+        gtk_box_pack_start (GUI->vuGraphicMetersBox, GTK_WIDGET (bar), TRUE, TRUE, 2);
+        GUI->vuGraphicMeters[i] = bar;
+        
+        /* numeric button */
+        button = GTK_BUTTON (gtk_button_new_with_label ("0"));
+        gtk_widget_set_name (GTK_WIDGET (button), val);
+        gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "vu-numeric-meter");
+        g_signal_connect (GTK_WIDGET (button), "clicked", G_CALLBACK (arResetNumericMeter), NULL);
+        gtk_box_pack_start (GTK_BOX (GUI->vuNumericMetersBox), GTK_WIDGET (button), TRUE, TRUE, 2);
+        GUI->vuNumericMeters[i] = button;
+
+        /* label */        
+        label =  GTK_LABEL (gtk_label_new (ch));
+        gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (label)), "vu-label");
+        gtk_box_pack_start (GUI->vuLabelsBox, GTK_WIDGET (label), TRUE, TRUE, 2);        
+    }
+    gtk_widget_show_all (GTK_WIDGET (GUI->vuGraphicMetersBox));
+    gtk_widget_show_all (GTK_WIDGET (GUI->vuNumericMetersBox));
+    gtk_widget_show_all (GTK_WIDGET (GUI->vuLabelsBox));
+}
+
+/* a capture for p_aw_pcm_ with the options in use, for the caller to change before opening */
+ArCapture* arNewCapture (AwPcm* p_aw_pcm_)
+{
+    ArCapture* p_cap;
+
+    if ((p_cap = calloc (1, sizeof (ArCapture))) == NULL)
+        return NULL;
+
+    (*p_cap).p_aw_pcm = p_aw_pcm_;
+    (*p_cap).default_pcm = defaultPcm;
+    (*p_cap).params = aw_pcm_params;
+    (*p_cap).p_tuned_pcm = p_tuned_pcm;
+    (*p_cap).tuned_framerate = tunedFramerate;
+
+    if (defaultPcm)
+    {
+        (*p_cap).hw_nchannels = _nchannels;
+        (*p_cap).hw_framerate = _framerate;
+        (*p_cap).hw_format = _format;
+
+    } else {
+
+        (*p_cap).hw_nchannels = aw_pcm_params.nchannels;
+        (*p_cap).hw_framerate = aw_pcm_params.framerate;
+        (*p_cap).hw_format = aw_pcm_params.format;
+    }
+    (*p_cap).state = AW_STOPPED;
+
+    return p_cap;
+}
+
+/* hw options a device starts with: the defaults when it has them, its first ones otherwise */
+int arHwDefaults (AwPcm* p_aw_pcm_, uint8_t* p_nchannels, uint32_t* p_framerate, snd_pcm_format_t* p_format)
+{
+    int i;
+
+    *p_nchannels = (*p_aw_pcm_).nchannels[0];
+
+    for (i = 0; i < AW_MAX_NCHANNELS_LENGTH && (*p_aw_pcm_).nchannels[i] != -1; i++)
+        if ((*p_aw_pcm_).nchannels[i] == AW_DEFAULT_NCHANNELS)
+            *p_nchannels = AW_DEFAULT_NCHANNELS;
+
+    *p_framerate = (*p_aw_pcm_).framerates[0];
+
+    for (i = 0; i < AW_MAX_FRAMERATES_LENGTH && (*p_aw_pcm_).framerates[i] != -1; i++)
+        if ((*p_aw_pcm_).framerates[i] == AW_DEFAULT_FRAMERATE)
+            *p_framerate = AW_DEFAULT_FRAMERATE;
+
+    *p_format = (*p_aw_pcm_).formats[0];
+
+    for (i = 0; i < AW_MAX_FORMATS_LENGTH && (*p_aw_pcm_).formats[i] != -1; i++)
+        if ((*p_aw_pcm_).formats[i] == AW_DEFAULT_FORMAT)
+            *p_format = AW_DEFAULT_FORMAT;
+
+    return 0;
+}
+
+/* options a device starts with: its hw defaults, or the cd quality ones through plughw when there is */
+int arPcmDefaults (ArCapture* p_cap)
+{
+    AwPcm* p_aw_pcm_ = (*p_cap).p_aw_pcm;
+
+    arHwDefaults (p_aw_pcm_, &(*p_cap).hw_nchannels, &(*p_cap).hw_framerate, &(*p_cap).hw_format);
+
+    if (((*p_cap).default_pcm = (*p_aw_pcm_).has_plughw))
+    {
+        (*p_cap).params.nchannels = AW_DEFAULT_NCHANNELS;
+        (*p_cap).params.framerate = AW_DEFAULT_FRAMERATE;
+        (*p_cap).params.format = AW_DEFAULT_FORMAT;
+
+    } else {
+
+        (*p_cap).params.nchannels = (*p_cap).hw_nchannels;
+        (*p_cap).params.framerate = (*p_cap).hw_framerate;
+        (*p_cap).params.format = (*p_cap).hw_format;
+    }
+    return 0;
+}
+
+/* 
+ * opens an extra device with its hw defaults at the framerate and period of the selected one,
+ * names not in the device list (plughw, dsnoop ...) with the cd quality ones.
+*/
+int arExtraOpen (ArCapture* p_cap, ArExtraStream* p_extra, const char* name)
+{
+    uint32_t framerate;
+    int i;
+
+    snprintf ((*p_extra).name, sizeof (*p_extra).name, "%s", name);
+
+    (*p_extra).params = (*p_cap).params;
+    (*p_extra).params.nchannels = AW_DEFAULT_NCHANNELS;
+    (*p_extra).params.format = AW_DEFAULT_FORMAT;
+
+    for (i = 0; i < aw_pcms_length; i++)
+    {
+        if (aw_pcms[i].card >= 0 && strcmp (aw_pcms[i].name, name) == 0)
+        {
+            arProbePcm (&aw_pcms[i]);
+            arHwDefaults (&aw_pcms[i], &(*p_extra).params.nchannels, &framerate, &(*p_extra).params.format);
+            break;
+        }
+    }
+    if (((*p_cap).err = snd_pcm_open (&(*p_extra).p_pcm, name, SND_PCM_STREAM_CAPTURE, SND_PCM_ASYNC)) < 0)
+        return aw_handle_err (snd_strerror ((*p_cap).err));
+
+    if (((*p_cap).err = aw_set_params ((*p_extra).p_pcm, &(*p_extra).params)) < 0)
+    {
+        snd_pcm_close ((*p_extra).p_pcm);
+        return aw_handle_err ("cannot set params");  
+    }
+
+    printf ("extra device %s\n", name);
+    aw_print_params ((*p_extra).params);
+
+    if (((*p_cap).err = aw_writer_start (&(*p_extra).writer, &(*p_extra).params, ringDepth, preroll, &(*p_extra).p_f)) < 0)
+    {
+        snd_pcm_close ((*p_extra).p_pcm);
+        return aw_handle_err ("cannot start writer");
+    }
+
+    return 0;
+}
+
+/* releases the extra devices opened so far */
+int arExtrasClose (ArCapture* p_cap)
+{
+    for (; (*p_cap).nextras > 0; (*p_cap).nextras--)
+    {
+        aw_writer_stop (&(*p_cap).extras[(*p_cap).nextras - 1].writer);
+        snd_pcm_close ((*p_cap).extras[(*p_cap).nextras - 1].p_pcm);
+    }
+    return 0;
+}
+
+/* opens, sets and starts the capture, nothing is left open on failure; touches no gtk, runs off the gtk thread */
+int arCaptureOpen (ArCapture* p_cap)
+{
+    char name[sizeof (*(*p_cap).p_aw_pcm).name + sizeof "plug"];
+    int i;
+    
+    /* open and set pcm */
+    
+    if ((*p_cap).default_pcm)
+    {
+        snprintf (name, sizeof name, "plug%s", (*(*p_cap).p_aw_pcm).name);
+            
+    } else {
+
+        snprintf (name, sizeof name, "%s", (*(*p_cap).p_aw_pcm).name);
+    }
+    if (((*p_cap).err = snd_pcm_open (&(*p_cap).p_pcm, name, SND_PCM_STREAM_CAPTURE, SND_PCM_ASYNC)) < 0)
+        return aw_handle_err (snd_strerror ((*p_cap).err));
+    
+    (*p_cap).params.access = noMmap ? SND_PCM_ACCESS_RW_INTERLEAVED : SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+    if (latencyProfile == AW_LATENCY_AUTO && ((*p_cap).p_tuned_pcm != (*p_cap).p_aw_pcm || (*p_cap).tuned_framerate != (*p_cap).params.framerate))
+    {
+        if (((*p_cap).err = aw_autotune ((*p_cap).p_pcm, &(*p_cap).params, (*p_cap).p_aw_pcm, &rt)) < 0)
+        {
+            // a stuck tuning thread still uses the pcm, it is left open
+            if ((*p_cap).err != -ETIMEDOUT)
+                snd_pcm_close ((*p_cap).p_pcm);
+            return aw_handle_err ("cannot set params");  
+        }
+        (*p_cap).p_tuned_pcm = (*p_cap).p_aw_pcm;
+        (*p_cap).tuned_framerate = (*p_cap).params.framerate;
+
+    } else if (((*p_cap).err = aw_set_params ((*p_cap).p_pcm, &(*p_cap).params)) < 0) {
+
+        snd_pcm_close ((*p_cap).p_pcm);
+        return aw_handle_err ("cannot set params");  
+    }
+    
+    aw_print_params ((*p_cap).params);
+
+    if (((*p_cap).err = aw_writer_start (&(*p_cap).writer, &(*p_cap).params, ringDepth, preroll, &(*p_cap).p_f)) < 0)
+    {
+        snd_pcm_close ((*p_cap).p_pcm);
+        return aw_handle_err ("cannot start writer");
+    }
+
+    /* extra devices, serviced by the same thread and started with the selected one */
+
+    for (i = 0; extraDevices != NULL && extraDevices[i] != NULL && (*p_cap).nextras < MAX_EXTRA_DEVICES; i++)
+    {
+        if (arExtraOpen (p_cap, &(*p_cap).extras[(*p_cap).nextras], extraDevices[i]) < 0)
+        {
+            arExtrasClose (p_cap);
+            aw_writer_stop (&(*p_cap).writer);
+            snd_pcm_close ((*p_cap).p_pcm);
+            return -1;
+        }
+        (*p_cap).nextras++;
+    }
+
+    // in rt mode every buffer the capture thread touches is resident before the streams start
+    if (rt.enabled)
+    {
+        aw_writer_prefault (&(*p_cap).writer);
+
+        for (i = 0; i < (*p_cap).nextras; i++)
+            aw_writer_prefault (&(*p_cap).extras[i].writer);
+
+        aw_rt_lock_memory ();
+    }
+
+    (*p_cap).streams[0].p_pcm = (*p_cap).p_pcm;
+    (*p_cap).streams[0].p_hw_params = &(*p_cap).params;
+    (*p_cap).streams[0].p_writer = &(*p_cap).writer;
+    (*p_cap).streams[0].p_ss = &(*p_cap).ss;
+
+    for (i = 0; i < (*p_cap).nextras; i++)
+    {
+        (*p_cap).streams[i + 1].p_pcm = (*p_cap).extras[i].p_pcm;
+        (*p_cap).streams[i + 1].p_hw_params = &(*p_cap).extras[i].params;
+        (*p_cap).streams[i + 1].p_writer = &(*p_cap).extras[i].writer;
+        (*p_cap).streams[i + 1].p_ss = &(*p_cap).extras[i].ss;
+    }
+
+    if (((*p_cap).err = aw_streams_start ((*p_cap).streams, (*p_cap).nextras + 1)) < 0)
+    {
+        arExtrasClose (p_cap);
+        aw_writer_stop (&(*p_cap).writer);
+        snd_pcm_close ((*p_cap).p_pcm);
+        return -1;
+    }
+    
+    (*p_cap).state = AW_MONITORING;
+            
+    /* prepare stats struct */
+
+    aw_build_compute_struct ((*p_cap).params, &(*p_cap).ss);
+
+    for (i = 0; i < (*p_cap).nextras; i++)
+        aw_build_compute_struct ((*p_cap).extras[i].params, &(*p_cap).extras[i].ss);
+    
+    /* start thread */
+
+    (*p_cap).thread_struct.p_state = &(*p_cap).state; 
+    (*p_cap).thread_struct.p_streams = (*p_cap).streams;
+    (*p_cap).thread_struct.nstreams = (*p_cap).nextras + 1;
+    
+    if (((*p_cap).err = aw_thread_start (&(*p_cap).thread_id, &(*p_cap).thread_struct, &rt)) < 0)
+    {
+        (*p_cap).state = AW_STOPPED;
+        aw_free_compute_struct (&(*p_cap).ss);
+
+        for (i = 0; i < (*p_cap).nextras; i++)
+            aw_free_compute_struct (&(*p_cap).extras[i].ss);
+
+        arExtrasClose (p_cap);
+        aw_writer_stop (&(*p_cap).writer);
+        snd_pcm_close ((*p_cap).p_pcm);
+        return aw_handle_err ("cannot start capture thread");
+    }
+    return 0;
+}
+
+/* stops the capture thread and releases the devices, buffers and meters stay for the gtk thread; -1 when the thread does not stop */
+int arCaptureStop (ArCapture* p_cap)
+{
+    int i;
+
+    if ((*p_cap).p_pcm == NULL)
+        return 0;
+
+    if (aw_thread_stop ((*p_cap).thread_id, &(*p_cap).thread_struct, AW_THREAD_STOP_TIMEOUT) < 0)
+        return -1;
+
+    for (i = 0; i < (*p_cap).nextras; i++)
+        snd_pcm_close ((*p_cap).extras[i].p_pcm);
+
+    (*p_cap).err = snd_pcm_close ((*p_cap).p_pcm);
+    (*p_cap).p_pcm = NULL;
+
+    return 0;
+}
+
+/* stops and closes the capture, -1 leaves it as it is when its thread does not stop */
+int arCaptureClose (ArCapture* p_cap)
+{      
+    int i;
+
+    if (arCaptureStop (p_cap) < 0)
+        return -1;
+
+    aw_writer_stop (&(*p_cap).writer);
+    
+    /* free stats struct */
+
+    aw_free_compute_struct (&(*p_cap).ss);       
+
+    for (i = 0; i < (*p_cap).nextras; i++)
+    {
+        aw_free_compute_struct (&(*p_cap).extras[i].ss);
+        aw_writer_stop (&(*p_cap).extras[i].writer);
+    }
+    (*p_cap).nextras = 0;
+
+    if ((*p_cap).err < 0)
+        return aw_handle_err (snd_strerror ((*p_cap).err));
+
+    return 0;
+}
+
+/* a capture with the device and options of p_cap, for reopening it */
+ArCapture* arCloneCapture (ArCapture* p_cap)
+{
+    ArCapture* p_clone;
+
+    if ((p_clone = calloc (1, sizeof (ArCapture))) == NULL)
+        return NULL;
+
+    (*p_clone).p_aw_pcm = (*p_cap).p_aw_pcm;
+    (*p_clone).default_pcm = (*p_cap).default_pcm;
+    (*p_clone).params = (*p_cap).params;
+    (*p_clone).hw_nchannels = (*p_cap).hw_nchannels;
+    (*p_clone).hw_framerate = (*p_cap).hw_framerate;
+    (*p_clone).hw_format = (*p_cap).hw_format;
+    (*p_clone).p_tuned_pcm = (*p_cap).p_tuned_pcm;
+    (*p_clone).tuned_framerate = (*p_cap).tuned_framerate;
+    (*p_clone).state = AW_STOPPED;
+
+    return p_clone;
+}
+
+/* the opened capture becomes the one metered and recorded, into its own take file; the gui follows its options */
+int arCaptureCommit (ArCapture* p_cap)
+{
+    p_capture = p_cap;
+    p_aw_pcm = (*p_cap).p_aw_pcm;
+    aw_pcm_params = (*p_cap).params;
+    defaultPcm = (*p_cap).default_pcm;
+    _nchannels = (*p_cap).hw_nchannels;
+    _framerate = (*p_cap).hw_framerate;
+    _format = (*p_cap).hw_format;
+    p_tuned_pcm = (*p_cap).p_tuned_pcm;
+    tunedFramerate = (*p_cap).tuned_framerate;
+    xrunsLogged = 0;
+
+    return 0;
+}
+
+int arPcmStart ()
+{
+    ArCapture* p_cap;
+
+    if ((p_cap = arNewCapture (p_aw_pcm)) == NULL)
+        return -1;
+
+    arPcmDefaults (p_cap);
+
+    // opened like a switch from no capture, a tuning run keeps the window responsive
+    return arPcmSwitch (p_cap);
+}
+
+int arPcmStop ()
+{
+    int err = arCaptureClose (p_capture);
+
+    // a capture thread that would not stop keeps its buffers
+    if (err == 0)
+        free (p_capture);
+    p_capture = NULL;
+
+    return err;
+}
+
+/* device buttons follow the device in use, also when a switch to another one failed */
+int arSelectPcmDeviceButton ()
+{
+    GList* children;
+    GList* iter;
+
+    children = gtk_container_get_children (GTK_CONTAINER (GUI->deviceOptionsButtonBox));
 
-    children = gtk_container_get_children (GTK_CONTAINER (GUI->vuLabelsBox));
+    for (iter = children; iter != NULL; iter = g_list_next (iter))
+    {
+        if (strcmp (gtk_widget_get_name (GTK_WIDGET (iter->data)), (*p_aw_pcm).name) == 0)
+            gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (iter->data), TRUE);
+    }
+    g_list_free (children);
 
-    for (iter=children; iter != NULL; iter = g_list_next (iter)) 
-        gtk_widget_destroy (GTK_WIDGET (iter->data));
+    return 0;
+}
 
-    g_list_free (children);
+/* back on the gtk thread: commit what the switch thread left running and close the capture it replaces */
+gboolean arPcmSwitchDone (gpointer p_switch_)
+{
+    ArSwitch* p_switch = p_switch_;
+    ArCapture* p_new = (*p_switch).p_new;
+    ArCapture* p_old = (*p_switch).p_old;
 
-    /* draw vu meters (graphic, buttons, labels) */  
-    
-    for (i = 0; i < aw_pcm_params.nchannels; i++)
+    // the old capture was stopped for a restart that failed, the reopened one takes its place
+    if ((*p_new).err < 0 && p_old != NULL && (*p_old).p_pcm == NULL)
     {
-        snprintf (val, sizeof val, "%d", i);
-        snprintf (ch, sizeof ch, "ch %d", i);
+        printf ("cannot switch to %s, back to the previous options\n", (*(*p_new).p_aw_pcm).name);
+        free (p_new);
 
-        /* graphic */
-        bar = GTK_LEVEL_BAR (gtk_level_bar_new_for_interval (0, 100));
-        gtk_level_bar_set_value (bar, 70);
-        gtk_level_bar_set_inverted (bar, TRUE);
-        gtk_orientable_set_orientation (GTK_ORIENTABLE (bar), GTK_ORIENTATION_VERTICAL);
-        gtk_level_bar_set_mode (bar, GTK_LEVEL_BAR_MODE_DISCRETE);
-        gtk_box_pack_start (GUI->vuGraphicMetersBox, GTK_WIDGET (bar), TRUE, TRUE, 2);
-        GUI->vuGraphicMeters[i] = bar;
-        
-        /* numeric button */
-        button = GTK_BUTTON (gtk_button_new_with_label ("0"));
-        gtk_widget_set_name (GTK_WIDGET (button), val);
-        gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "vu-numeric-meter");
-        g_signal_connect (GTK_WIDGET (button), "clicked", G_CALLBACK (arResetNumericMeter), NULL);
-        gtk_box_pack_start (GTK_BOX (GUI->vuNumericMetersBox), GTK_WIDGET (button), TRUE, TRUE, 2);
-        GUI->vuNumericMeters[i] = button;
+        if ((p_new = (*p_switch).p_back) == NULL || (*p_new).err < 0)
+        {
+            printf ("pcm not working");
+            free (p_new);
+            free (p_switch);
+            p_pending = NULL;
+            arQuit_ ();
+            return G_SOURCE_REMOVE;
+        }
+    }
 
-        /* label */        
-        label =  GTK_LABEL (gtk_label_new (ch));
-        gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (label)), "vu-label");
-        gtk_box_pack_start (GUI->vuLabelsBox, GTK_WIDGET (label), TRUE, TRUE, 2);        
+    if ((*p_new).err < 0 && p_old == NULL)
+    {
+        printf ("pcm not working");
+        free (p_new);
+        free (p_switch);
+        p_pending = NULL;
+        arQuit_ ();
+        return G_SOURCE_REMOVE;
     }
-    gtk_widget_show_all (GTK_WIDGET (GUI->vuGraphicMetersBox));
-    gtk_widget_show_all (GTK_WIDGET (GUI->vuNumericMetersBox));
-    gtk_widget_show_all (GTK_WIDGET (GUI->vuLabelsBox));
-}
 
-int arPcmStart ()
-{      
-    pthread_t thread_id;
-    char name[sizeof (*p_aw_pcm).name + sizeof "plug"];
-    
-    /* open and set pcm */
-    
-    if (defaultPcm)
+    if ((*p_new).err < 0)
     {
-        snprintf (name, sizeof name, "plug%s", (*p_aw_pcm).name);
-            
+        printf ("cannot switch to %s, keeping %s\n", (*(*p_new).p_aw_pcm).name, (*p_aw_pcm).name);
+        free (p_new);
+
     } else {
 
-        snprintf (name, sizeof name, "%s", (*p_aw_pcm).name);
+        arCaptureCommit (p_new);
+
+        // the first capture starts the meters
+        if (p_old == NULL)
+            g_timeout_add (UPDATE_TIMER_INTERVAL, (GSourceFunc) arUpdateStatsAndVUMeters, NULL);
+
+        else if (arCaptureClose (p_old) == 0)
+            free (p_old);
     }
-    if ((err = snd_pcm_open (&p_pcm, name, SND_PCM_STREAM_CAPTURE, SND_PCM_ASYNC)) < 0)
-        return aw_handle_err (snd_strerror (err));
-    
-    if ((err = aw_set_params (p_pcm, &aw_pcm_params)) < 0)
-        return aw_handle_err ("cannot set params");  
-    
-    aw_print_params (aw_pcm_params);
+    free (p_switch);
+    p_pending = NULL;
 
-    if ((err = snd_pcm_prepare (p_pcm)) < 0)
-        return aw_handle_err (snd_strerror (err));
-        
-    if ((err = snd_pcm_state (p_pcm)) != SND_PCM_STATE_PREPARED)
-        return aw_handle_err( snd_strerror (err));
-    
-    if ((err = snd_pcm_start (p_pcm)) < 0)
-        return aw_handle_err (snd_strerror (err));
-    
-    state = AW_MONITORING;
-            
-    /* prepare stats struct */
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->deviceOptionsButtonBox), TRUE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->recordstopButton), TRUE);
+    arSelectPcmDeviceButton ();
+    arUpdatePcmOptionsPanel ();
 
-    aw_build_compute_struct (aw_pcm_params, &ss);   
-    
-    /* start thread */
+    return G_SOURCE_REMOVE;
+}
 
-    thread_struct.p_pcm = p_pcm;
-    thread_struct.p_hw_params = &aw_pcm_params;
-    thread_struct.p_p_f = &p_f;
-    thread_struct.p_ss = &ss;
-    thread_struct.p_state = &state; 
-    
-    pthread_create (&thread_id, NULL, aw_thread_func, (void*) &thread_struct); 
-    
-    sleep (0.5);
-    
-    g_timeout_add (UPDATE_TIMER_INTERVAL, (GSourceFunc) arUpdateStatsAndVUMeters, NULL);    
-    
-    return 0;
+/* 
+ * opens the new capture; a hw device opens once, so when it is busy on the card in use or on an extra device
+ * the old capture is stopped first, and reopened with its options if the new ones still fail
+*/
+gpointer arPcmSwitchThread (gpointer p_switch_)
+{
+    ArSwitch* p_switch = p_switch_;
+    ArCapture* p_new = (*p_switch).p_new;
+    ArCapture* p_old = (*p_switch).p_old;
+
+    if (arCaptureOpen (p_new) < 0 && (*p_new).err == -EBUSY && p_old != NULL
+        && ((*(*p_new).p_aw_pcm).card == (*(*p_old).p_aw_pcm).card || extraDevices != NULL))
+    {
+        printf ("%s busy, restarting\n", (*(*p_new).p_aw_pcm).name);
+
+        if (arCaptureStop (p_old) == 0 && arCaptureOpen (p_new) < 0)
+        {
+            if (((*p_switch).p_back = arCloneCapture (p_old)) != NULL)
+                arCaptureOpen ((*p_switch).p_back);
+        }
+    }
+    g_idle_add (arPcmSwitchDone, p_switch);
+
+    return NULL;
 }
 
-int arPcmStop ()
-{      
-    state = AW_STOPPING;
+/* the new capture opens and starts in background, the old one keeps metering until arPcmSwitchDone */
+int arPcmSwitch (ArCapture* p_new)
+{
+    ArSwitch* p_switch;
 
-    while (state != AW_STOPPED) sleep (0.1);    
-    
-    /* free stats struct */
+    if ((p_switch = calloc (1, sizeof (ArSwitch))) == NULL)
+    {
+        free (p_new);
+        return -1;
+    }
+    (*p_switch).p_new = p_new;
+    (*p_switch).p_old = p_capture;
+    p_pending = p_new;
 
-    aw_free_compute_struct (&ss);       
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->deviceOptionsButtonBox), FALSE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmPlugHwButton), FALSE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), FALSE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), FALSE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), FALSE);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->recordstopButton), FALSE);
 
-    if ((err = snd_pcm_close (p_pcm)) < 0)
-        return aw_handle_err (snd_strerror(err));
+    g_thread_unref (g_thread_new ("switch", arPcmSwitchThread, p_switch));
 
     return 0;
 }
 
+/* entries in use must not move or lose their name under the running or the opening capture */
+int arPcmInUse (AwPcm* p_aw_pcm_)
+{
+    return p_aw_pcm_ == p_aw_pcm || (p_pending != NULL && p_aw_pcm_ == (*p_pending).p_aw_pcm);
+}
+
 int arChangePcmOptionsNChannels (GtkRadioButton* button) {
 
-    uint8_t old_nchannels;
+    ArCapture* p_new;
     int i;
 
-    if (state == AW_RECORDING || state == AW_PAUSED) return 0;
+    if (p_pending != NULL || (*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED) return 0;
 
     if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button)))
     {
@@ -645,28 +1572,21 @@ int arChangePcmOptionsNChannels (GtkRadioButton* button) {
         
         if (aw_pcm_params.nchannels != (*p_aw_pcm).nchannels[i])
         {
-            // TODO: freeze gui with restart icon
-            arPcmStop ();
-            old_nchannels = aw_pcm_params.nchannels;
-            aw_pcm_params.nchannels = (*p_aw_pcm).nchannels[i];       
-            if (arPcmStart () != 0){
-                aw_pcm_params.nchannels = old_nchannels;
-                if (arPcmStart () != 0)
-                    arQuit_ ();
-                // TODO: reset old button
-            }
-            // TODO: unfreeze gui with restart icon
+            if ((p_new = arNewCapture (p_aw_pcm)) == NULL)
+                return -1;
+
+            (*p_new).params.nchannels = (*p_new).hw_nchannels = (*p_aw_pcm).nchannels[i];
+            arPcmSwitch (p_new);
         }
     }
-    arDrawVUMeters ();
 }
 
 int arChangePcmOptionsFramerate (GtkRadioButton* button) {
     
-    uint32_t old_framerate;
+    ArCapture* p_new;
     int i;
 
-    if (state == AW_RECORDING || state == AW_PAUSED) return 0;
+    if (p_pending != NULL || (*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED) return 0;
 
     if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button)))
     {
@@ -674,29 +1594,21 @@ int arChangePcmOptionsFramerate (GtkRadioButton* button) {
         
         if (aw_pcm_params.framerate != (*p_aw_pcm).framerates[i])
         {
-            // TODO: freeze gui with restart icon
-            arPcmStop ();
-            old_framerate = aw_pcm_params.framerate;
-            aw_pcm_params.framerate = (*p_aw_pcm).framerates[i];     
-            if (arPcmStart () != 0)
-            {
-                aw_pcm_params.framerate = old_framerate;
-                if (arPcmStart () != 0)
-                    arQuit_ ();
-                // TODO: reset old button
-            }
-            // TODO: unfreeze gui with restart icon
+            if ((p_new = arNewCapture (p_aw_pcm)) == NULL)
+                return -1;
+
+            (*p_new).params.framerate = (*p_new).hw_framerate = (*p_aw_pcm).framerates[i];
+            arPcmSwitch (p_new);
         }
-    
     }
 }
 
 int arChangePcmOptionsFormat (GtkRadioButton* button) {
     
-    snd_pcm_format_t old_format;
+    ArCapture* p_new;
     int i;
 
-    if (state == AW_RECORDING || state == AW_PAUSED) return 0;
+    if (p_pending != NULL || (*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED) return 0;
 
     if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button)))
     {
@@ -704,65 +1616,40 @@ int arChangePcmOptionsFormat (GtkRadioButton* button) {
         
         if (aw_pcm_params.format != (*p_aw_pcm).formats[i])
         {
-            // TODO: freeze gui with restart icon
-            arPcmStop ();
-            old_format = aw_pcm_params.format;
-            aw_pcm_params.format = (*p_aw_pcm).formats[i];      
-            if (arPcmStart () != 0){
-                aw_pcm_params.format = old_format;
-                if (arPcmStart () != 0)
-                    arQuit_ ();
-                // TODO: reset old button
-            }
-            // TODO: unfreeze gui with restart icon
+            if ((p_new = arNewCapture (p_aw_pcm)) == NULL)
+                return -1;
+
+            (*p_new).params.format = (*p_new).hw_format = (*p_aw_pcm).formats[i];
+            arPcmSwitch (p_new);
         }
     }
 }
 
 int arSwitchDefaultPcm (GtkToggleButton* button)
 {
-    arPcmStop ();
-
-    if (gtk_toggle_button_get_active (button))
-    {
-        defaultPcm = 1;
-
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), FALSE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), FALSE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), FALSE);
+    ArCapture* p_new;
 
-        _nchannels = aw_pcm_params.nchannels;
-        _framerate = aw_pcm_params.framerate;
-        _format = aw_pcm_params.format;
+    if (p_pending != NULL || (*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED) return 0;
 
-        aw_pcm_params.nchannels = AW_DEFAULT_NCHANNELS;
-        aw_pcm_params.framerate = AW_DEFAULT_FRAMERATE;
-        aw_pcm_params.format = AW_DEFAULT_FORMAT;       
-
-        arDrawVUMeters ();        
+    if ((p_new = arNewCapture (p_aw_pcm)) == NULL)
+        return -1;
 
-        if (arPcmStart () != 0)
-            arQuit_ ();
+    if (((*p_new).default_pcm = gtk_toggle_button_get_active (button)))
+    {
+        (*p_new).params.nchannels = AW_DEFAULT_NCHANNELS;
+        (*p_new).params.framerate = AW_DEFAULT_FRAMERATE;
+        (*p_new).params.format = AW_DEFAULT_FORMAT;       
             
     } else {
         
-        defaultPcm = 0;
-
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), TRUE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), TRUE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), TRUE);  
-
-        aw_pcm_params.nchannels = _nchannels;
-        aw_pcm_params.framerate = _framerate;
-        aw_pcm_params.format = _format;
-        
-        arDrawVUMeters ();   
-        
-        if (arPcmStart () != 0)
-            arQuit_ ();              
+        (*p_new).params.nchannels = (*p_new).hw_nchannels;
+        (*p_new).params.framerate = (*p_new).hw_framerate;
+        (*p_new).params.format = (*p_new).hw_format;
     }    
+    arPcmSwitch (p_new);
 }
 
+/* draws the options of the device in use, the active buttons are the committed options */
 int arUpdatePcmOptionsPanel ()
 {
     GList* children;
@@ -797,7 +1684,6 @@ int arUpdatePcmOptionsPanel ()
 
     /* draw nchannels radio box */  
     
-    aw_pcm_params.nchannels = (*p_aw_pcm).nchannels[0];
     group = NULL;
     
     for (i = 0; i < AW_MAX_NCHANNELS_LENGTH; i++)
@@ -814,11 +1700,9 @@ int arUpdatePcmOptionsPanel ()
 
         gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "option-button");
         
-        if ((*p_aw_pcm).nchannels[i] == AW_DEFAULT_NCHANNELS)
-        {                  
+        if ((*p_aw_pcm).nchannels[i] == (defaultPcm ? _nchannels : aw_pcm_params.nchannels))
             gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), TRUE);
-            aw_pcm_params.nchannels = AW_DEFAULT_NCHANNELS;
-        }
+
         g_signal_connect(GTK_WIDGET (button), "clicked", G_CALLBACK (arChangePcmOptionsNChannels), NULL);
         gtk_container_add (GTK_CONTAINER (GUI->pcmNchannelsOptions), GTK_WIDGET (button));
     }
@@ -826,8 +1710,6 @@ int arUpdatePcmOptionsPanel ()
 
     /* draw framerates radio box */   
 
-    aw_pcm_params.framerate = (*p_aw_pcm).framerates[0];
-    
     group = NULL;
     
     for (i = 0; i < AW_MAX_FRAMERATES_LENGTH; i++)
@@ -844,11 +1726,9 @@ int arUpdatePcmOptionsPanel ()
 
         gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "option-button");
         
-        if ((*p_aw_pcm).framerates[i] == AW_DEFAULT_FRAMERATE)
-        {
+        if ((*p_aw_pcm).framerates[i] == (defaultPcm ? _framerate : aw_pcm_params.framerate))
             gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), TRUE);
-            aw_pcm_params.framerate = AW_DEFAULT_FRAMERATE;
-        }
+
         g_signal_connect (GTK_WIDGET (button), "clicked", G_CALLBACK (arChangePcmOptionsFramerate), NULL);
         gtk_container_add (GTK_CONTAINER (GUI->pcmFramerateOptions), GTK_WIDGET (button));
     }
@@ -856,7 +1736,6 @@ int arUpdatePcmOptionsPanel ()
 
     /* draw formats radio box */   
 
-    aw_pcm_params.format = (*p_aw_pcm).formats[0];
     group = NULL;
     
     for (i = 0; i < AW_MAX_FORMATS_LENGTH; i++)
@@ -872,12 +1751,9 @@ int arUpdatePcmOptionsPanel ()
         gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), FALSE);
         gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (button)), "option-button");
         
-        if ((*p_aw_pcm).formats[i] == AW_DEFAULT_FORMAT)
-        {                  
+        if ((*p_aw_pcm).formats[i] == (defaultPcm ? _format : aw_pcm_params.format))
             gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), TRUE);
-            aw_pcm_params.format = AW_DEFAULT_FORMAT;
 
-        }
         g_signal_connect(GTK_WIDGET (button), "clicked", G_CALLBACK (arChangePcmOptionsFormat), NULL);
         gtk_container_add (GTK_CONTAINER (GUI->pcmFormatOptions), GTK_WIDGET (button));
     }
@@ -891,35 +1767,13 @@ int arUpdatePcmOptionsPanel ()
     if (GUI->pcmPlugHwButtonId > 0){
         g_signal_handler_disconnect (GTK_WIDGET (GUI->pcmPlugHwButton), GUI->pcmPlugHwButtonId);}
 
-    if ((*p_aw_pcm).has_plughw)
-    {
-        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (GUI->pcmPlugHwButton), TRUE);
-    
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), FALSE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), FALSE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), FALSE);
-        
-        _nchannels = aw_pcm_params.nchannels;
-        _framerate = aw_pcm_params.framerate;
-        _format = aw_pcm_params.format;
-
-        aw_pcm_params.nchannels = AW_DEFAULT_NCHANNELS;
-        aw_pcm_params.framerate = AW_DEFAULT_FRAMERATE;
-        aw_pcm_params.format = AW_DEFAULT_FORMAT;  
-        
-        defaultPcm = 1;     
-     
-    } else {
-        
-        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (GUI->pcmPlugHwButton), FALSE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmPlugHwButton), FALSE);
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (GUI->pcmPlugHwButton), defaultPcm);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmPlugHwButton), (*p_aw_pcm).has_plughw);
 
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), TRUE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), TRUE);
-        gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), TRUE);        
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmNchannelsOptions), !defaultPcm);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFramerateOptions), !defaultPcm);
+    gtk_widget_set_sensitive (GTK_WIDGET (GUI->pcmFormatOptions), !defaultPcm);
 
-        defaultPcm = 0;
-    }        
     GUI->pcmPlugHwButtonId = g_signal_connect (GTK_WIDGET (GUI->pcmPlugHwButton), "toggled", G_CALLBACK (arSwitchDefaultPcm), NULL);
     
     arDrawVUMeters ();   
@@ -927,27 +1781,27 @@ int arUpdatePcmOptionsPanel ()
 
 int arChangePcmDevice (GtkRadioButton* button)
 {    
+    ArCapture* p_new;
     int i;
     
-    if (state == AW_RECORDING || state == AW_PAUSED) return 0;
+    if (p_pending != NULL || (*p_capture).state == AW_RECORDING || (*p_capture).state == AW_PAUSED) return 0;
     
     if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button)))
     {
         for (i = 0; i < aw_pcms_length; i++)
         {            
-            if (strcmp (gtk_widget_get_name (GTK_WIDGET (button)), aw_pcms[i].name) == 0)
+            if (aw_pcms[i].card >= 0 && strcmp (gtk_widget_get_name (GTK_WIDGET (button)), aw_pcms[i].name) == 0)
             {
                 if (&aw_pcms[i] != p_aw_pcm)
                 {
-                    // TODO: freeze gui with restart icon
-                    arPcmStop ();
-                    p_aw_pcm = &aw_pcms[i];                    
-                    arUpdatePcmOptionsPanel ();   
-                    
-                    aw_print_pcm (p_aw_pcm);
-
-                    if (arPcmStart () != 0) return -1;
-                    // TODO: unfreeze gui with restart icon
+                    arProbePcm (&aw_pcms[i]);
+                    aw_print_pcm (&aw_pcms[i]);
+
+                    if ((p_new = arNewCapture (&aw_pcms[i])) == NULL)
+                        return -1;
+
+                    arPcmDefaults (p_new);
+                    arPcmSwitch (p_new);
                 }
                 break;
             }
@@ -955,30 +1809,146 @@ int arChangePcmDevice (GtkRadioButton* button)
     }
 }
 
-int arDrawPcmDevicesPanel ()
-{   
-    int i;
+int arAddPcmDeviceButton (int i)
+{
     GtkRadioButton* button;
+    GList* children;
     GSList* group = NULL;
-    char cardname[32];
     char label[64];
+
+    /* join the group of the buttons already there */
+    children = gtk_container_get_children (GTK_CONTAINER (GUI->deviceOptionsButtonBox));
+
+    if (children != NULL)
+        group = gtk_radio_button_get_group (GTK_RADIO_BUTTON (children->data));
+    g_list_free (children);
+
+    snprintf (label, sizeof label, "%.31s (%s)", aw_pcms[i].cardname, aw_pcms[i].name);
+    button = GTK_RADIO_BUTTON (gtk_radio_button_new_with_label (group, label));
+    gtk_container_add (GTK_CONTAINER (GUI->deviceOptionsButtonBox), GTK_WIDGET (button));
+    gtk_widget_set_name (GTK_WIDGET (button), aw_pcms[i].name);
+
+    if (&aw_pcms[i] == p_aw_pcm)
+    {
+        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), TRUE);
+    }
+    g_signal_connect(GTK_WIDGET (button), "clicked", G_CALLBACK (arChangePcmDevice), NULL);
+
+    return 0;
+}
+
+int arDrawPcmDevicesPanel ()
+{   
+    int i;
     
     for (i = 0; i < aw_pcms_length; i++)
     {
-        strncpy (cardname, aw_pcms[i].cardname, sizeof cardname);
-        snprintf (label, sizeof label, "%s (%s)", cardname, aw_pcms[i].name);
-        button = GTK_RADIO_BUTTON (gtk_radio_button_new_with_label (group, label));
-        group = gtk_radio_button_get_group (button);
-        gtk_container_add (GTK_CONTAINER (GUI->deviceOptionsButtonBox), GTK_WIDGET (button));
-        gtk_widget_set_name (GTK_WIDGET (button), aw_pcms[i].name);
+        if (aw_pcms[i].card >= 0)
+            arAddPcmDeviceButton (i);
+    }
+    gtk_widget_show_all (GTK_WIDGET (GUI->deviceOptionsButtonBox));
+}
+
+/* a card appeared: list it into free entries, add its buttons, probe it in background */
+gboolean arCardAdded (gpointer p_card)
+{
+    int i;
+    int j;
+    int slot;
+    uint8_t length = 0;
+    AwPcm card_pcms[AW_MAX_PCMS_LENGTH];
+
+    for (i = 0; i < aw_pcms_length; i++)
+        if (aw_pcms[i].card == GPOINTER_TO_INT (p_card))
+            return G_SOURCE_REMOVE;
+
+    if (aw_list_card (GPOINTER_TO_INT (p_card), card_pcms, &length) < 0 || length == 0)
+        return G_SOURCE_REMOVE;
+
+    for (j = 0, slot = 0; j < length; j++)
+    {
+        /* entries of unplugged cards are reused first, the others never move */
+        for (; slot < aw_pcms_length && (aw_pcms[slot].card >= 0 || arPcmInUse (&aw_pcms[slot])); slot++);
+
+        if (slot == AW_MAX_PCMS_LENGTH)
+            break;
+
+        g_mutex_lock (&probeLocks[slot]);
+        aw_pcms[slot] = card_pcms[j];
+        g_mutex_unlock (&probeLocks[slot]);
+
+        if (slot == aw_pcms_length)
+            aw_pcms_length++;
+
+        arAddPcmDeviceButton (slot);
+        printf ("hotplug: %s (%s) added\n", aw_pcms[slot].name, aw_pcms[slot].cardname);
+    }
+    gtk_widget_show_all (GTK_WIDGET (GUI->deviceOptionsButtonBox));
+
+    atomic_fetch_add (&probesPending, 1);
+    g_thread_unref (g_thread_new ("probe", arProbeCard, p_card));
+
+    return G_SOURCE_REMOVE;
+}
+
+/* a card went away: drop its buttons and entries, the device in use is left to its capture thread */
+gboolean arCardRemoved (gpointer p_card)
+{
+    GList* children;
+    GList* iter;
+    int i;
+
+    children = gtk_container_get_children (GTK_CONTAINER (GUI->deviceOptionsButtonBox));
+
+    for (i = 0; i < aw_pcms_length; i++)
+    {
+        if (aw_pcms[i].card != GPOINTER_TO_INT (p_card))
+            continue;
+
+        printf ("hotplug: %s (%s) removed\n", aw_pcms[i].name, aw_pcms[i].cardname);
 
-        if (aw_pcms[i].name == (*p_aw_pcm).name)
+        for (iter = children; iter != NULL; iter = g_list_next (iter))
         {
-            gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button), TRUE);
+            if (strcmp (gtk_widget_get_name (GTK_WIDGET (iter->data)), aw_pcms[i].name) != 0)
+                continue;
+
+            if (arPcmInUse (&aw_pcms[i]))
+                gtk_widget_set_sensitive (GTK_WIDGET (iter->data), FALSE);
+            else
+                gtk_widget_destroy (GTK_WIDGET (iter->data));
         }
-        g_signal_connect(GTK_WIDGET (button), "clicked", G_CALLBACK (arChangePcmDevice), NULL);
+        // the device in use keeps its name until another one is selected
+        g_mutex_lock (&probeLocks[i]);
+        aw_pcms[i].card = -1;
+        aw_pcms[i].probed = 1;
+
+        if (!arPcmInUse (&aw_pcms[i]))
+            aw_pcms[i].name[0] = '\0';
+        g_mutex_unlock (&probeLocks[i]);
     }
-    gtk_widget_show_all (GTK_WIDGET (GUI->deviceOptionsButtonBox));
+    g_list_free (children);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* waits on card nodes and hands each change to the gtk thread, added cards after they settle */
+gpointer arHotplugThread (gpointer p_fd)
+{
+    AwHotplugEvent events[16];
+    int n;
+    int i;
+
+    while ((n = aw_hotplug_wait (GPOINTER_TO_INT (p_fd), events, 16)) >= 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].added)
+                g_timeout_add (HOTPLUG_SETTLE, arCardAdded, GINT_TO_POINTER (events[i].card));
+            else
+                g_idle_add (arCardRemoved, GINT_TO_POINTER (events[i].card));
+        }
+    }
+    return NULL;
 }
 
 int arSwitchVUFormat (GtkButton* button)
@@ -1003,6 +1973,10 @@ int arSwitchSaveFormat (GtkRadioButton* button)
         {
             saveFormat = SAVE_TO_MP3;
 
+        } else if (strcmp (gtk_widget_get_name (GTK_WIDGET (button)), "flac") == 0) {
+
+            saveFormat = SAVE_TO_FLAC;
+
         } else {
 
             saveFormat = SAVE_TO_WAV;
@@ -1025,10 +1999,103 @@ int main (int argc, char **argv)
     GdkDisplay* display;
     GdkScreen* screen;
     GtkCssProvider* provider;
+    GOptionContext* context;
+    int i;
+    GOptionEntry entries[] = {
+
+        { "ring-depth", 0, 0, G_OPTION_ARG_INT, &ringDepth, "Periods buffered between capture and disk writer", "N" },
+        { "no-mmap", 0, 0, G_OPTION_ARG_NONE, &noMmap, "Capture with read calls instead of mmap", NULL },
+        { "flac-threads", 0, 0, G_OPTION_ARG_INT, &flacThreads, "Threads encoding flac frames in parallel", "N" },
+        { "preroll", 0, 0, G_OPTION_ARG_DOUBLE, &preroll, "Seconds kept while monitoring and saved ahead of each take", "SEC" },
+        { "memory-budget", 0, 0, G_OPTION_ARG_INT, &memoryBudget, "Keep takes in memory up to this size, then spill to disk", "MB" },
+        { "mlock", 0, 0, G_OPTION_ARG_NONE, &lockMemory, "Lock in memory takes in RAM", NULL },
+        { "rt", 0, 0, G_OPTION_ARG_NONE, &rt.enabled, "Real time capture: SCHED_FIFO, locked and prefaulted memory", NULL },
+        { "rt-priority", 0, 0, G_OPTION_ARG_INT, &rt.priority, "SCHED_FIFO priority of the capture thread in rt mode", "1-99" },
+        { "rt-cpu", 0, 0, G_OPTION_ARG_INT, &rt.cpu, "Pin the capture thread to this cpu in rt mode", "N" },
+        { "rotate-minutes", 0, 0, G_OPTION_ARG_DOUBLE, &rotateMinutes, "Record continuously, starting a new file every N minutes", "N" },
+        { "rotate-size", 0, 0, G_OPTION_ARG_INT, &rotateSize, "Record continuously, starting a new file every N MB", "N" },
+        { "latency", 0, 0, G_OPTION_ARG_STRING, &latency, "Period and buffer sizes: low, balanced, low-wakeup or auto", "PROFILE" },
+        { "no-device-cache", 0, 0, G_OPTION_ARG_NONE, &noDeviceCache, "Probe every card at startup instead of reusing the cached capabilities", NULL },
+        { "extra-device", 0, 0, G_OPTION_ARG_STRING_ARRAY, &extraDevices, "Also capture this device in the same session, into its own files (repeatable)", "PCM" },
+        { NULL }
+    };
 
     struct passwd *pw = getpwuid (getuid ());
 
     
+    /*==============================
+        command line options
+    ==============================*/    
+
+
+    context = g_option_context_new (NULL);
+    g_option_context_add_main_entries (context, entries, NULL);
+    g_option_context_set_ignore_unknown_options (context, TRUE);
+
+    if (!g_option_context_parse (context, &argc, &argv, &err))
+    {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (ringDepth < 2)
+    {
+        fprintf (stderr, "ring depth must be at least 2\n");
+        return 1;
+    }
+    if (flacThreads < 1)
+    {
+        fprintf (stderr, "flac threads must be at least 1\n");
+        return 1;
+    }
+    if (rt.priority < 1 || rt.priority > 99)
+    {
+        fprintf (stderr, "rt priority must be between 1 and 99\n");
+        return 1;
+    }
+    if (rotateMinutes < 0 || rotateSize < 0)
+    {
+        fprintf (stderr, "rotation limits must not be negative\n");
+        return 1;
+    }
+    if (memoryBudget < 0)
+    {
+        fprintf (stderr, "memory budget must not be negative\n");
+        return 1;
+    }
+    if (preroll < 0 || preroll > MAX_PREROLL)
+    {
+        fprintf (stderr, "preroll must be between 0 and %d seconds\n", MAX_PREROLL);
+        return 1;
+    }
+    if (latency != NULL)
+    {
+        for (i = 0; i < AW_LATENCY_PROFILES_LENGTH && strcmp (latency, AW_LATENCY_PROFILES[i].name) != 0; i++);
+
+        if (i < AW_LATENCY_PROFILES_LENGTH)
+        {
+            latencyProfile = i;
+
+        } else if (strcmp (latency, "auto") == 0) {
+
+            latencyProfile = AW_LATENCY_AUTO;
+
+        } else {
+
+            fprintf (stderr, "latency must be low, balanced, low-wakeup or auto\n");
+            return 1;
+        }
+        g_free (latency);
+    }
+    if (latencyProfile != AW_LATENCY_AUTO)
+    {
+        aw_pcm_params.period_time = AW_LATENCY_PROFILES[latencyProfile].period_time;
+        aw_pcm_params.period_count = AW_LATENCY_PROFILES[latencyProfile].period_count;
+    }
+
+    
     /*==============================
         some test and deplayments
     ==============================*/    
@@ -1051,11 +2118,6 @@ int main (int argc, char **argv)
         printf("error create Recordings dir\n");
         return -1;
     }
-    if (system("ffmpeg -version") != 0)
-    {
-        haveMp3Transcoder = 0;
-        printf("no ffmpeg available: disable mp3 transcode\n");
-    }
 
 
     /*=============
@@ -1069,6 +2131,8 @@ int main (int argc, char **argv)
     
     if (arGetPcmDevice (&p_aw_pcm) < 0)
         return -1;
+
+    arProbePcm (p_aw_pcm);
         
     aw_print_pcm (p_aw_pcm);
     
@@ -1122,7 +2186,9 @@ int main (int argc, char **argv)
     /* device options */
 
     arDrawPcmDevicesPanel ();
-    arUpdatePcmOptionsPanel ();
+
+    if ((hotplugFd = aw_hotplug_open ()) >= 0)
+        g_thread_unref (g_thread_new ("hotplug", arHotplugThread, GINT_TO_POINTER (hotplugFd)));
 
     /* signals */   
 
@@ -1144,6 +2210,8 @@ int main (int argc, char **argv)
 
     gtk_label_set_text (GUI->timeLabel, "0.00");
 
+    exportPool = g_thread_pool_new (arExportJob, NULL, EXPORT_THREADS, FALSE, NULL);
+
     gtk_widget_show_all (window);
     if (arPcmStart () != 0)
     {
@@ -1155,6 +2223,9 @@ int main (int argc, char **argv)
         gtk_main ();
     }
 
+    // let running exports finish before leaving
+    g_thread_pool_free (exportPool, FALSE, TRUE);
+
     free (GUI);
 
     return 0;
@@ -15,12 +15,24 @@
  * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  *
- * compile with: gcc -o alsawrapper alsawrapper.c -lasound -lm
+ * compile with: gcc -c alsawrapper.c (link with -lasound -lmp3lame -lFLAC -lpthread -lm)
 */
 
 
+#define _GNU_SOURCE
+
 #include "alsawrapper.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 
 int aw_handle_err (const char* msg)
 {
@@ -46,7 +58,9 @@ int32_t aw_parser_S16_LE (char* p_sample)
 
 int32_t aw_parser_S24_3LE (char* p_sample)
 {
-    return (int32_t) (*p_sample + *(p_sample+1) + *(p_sample+2));
+    return ((int32_t) ((uint32_t) ((uint8_t*) p_sample)[0] << 8 | 
+                       (uint32_t) ((uint8_t*) p_sample)[1] << 16 | 
+                       (uint32_t) ((uint8_t*) p_sample)[2] << 24)) >> 8;
 }
 
 int32_t aw_parser_S32_LE (char* p_sample)
@@ -56,497 +70,2977 @@ int32_t aw_parser_S32_LE (char* p_sample)
 
 
 /*============================================================================
-                cards, pcms, confs
+                sample unpackers
 ============================================================================*/
 
 
-int aw_get_pcm_devices (AwPcm aw_pcms[], uint8_t* p_aw_pcms_length)
+/* bulk conversion of a whole period to sign-extended int32, used by metering and encoders */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#endif
+
+#define AW_LOAD_S8(p) ((int32_t) *((int8_t*) (p)))
+#define AW_LOAD_S16_LE(p) ((int32_t) *((int16_t*) (p)))
+#define AW_LOAD_S24_LE(p) (((int32_t) ((uint32_t) *((int32_t*) (p)) << 8)) >> 8)
+#define AW_LOAD_S24_3LE(p) aw_parser_S24_3LE ((char*) (p))
+#define AW_LOAD_S32_LE(p) (*((int32_t*) (p)))
+
+#define AW_UNPACKER(FORMAT, SAMPLESIZE)                                                             \
+static void aw_unpack_##FORMAT (char* p_src, int32_t* p_dst, size_t nsamples)                      \
+{                                                                                                   \
+    size_t i;                                                                                       \
+                                                                                                    \
+    for (i = 0; i < nsamples; i++)                                                                  \
+        p_dst[i] = AW_LOAD_##FORMAT (p_src + i * SAMPLESIZE);                                       \
+}
+
+AW_UNPACKER (S8, 1)
+AW_UNPACKER (S16_LE, 2)
+AW_UNPACKER (S24_LE, 4)
+AW_UNPACKER (S24_3LE, 3)
+AW_UNPACKER (S32_LE, 4)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* each 32 bit lane takes its 3 bytes in the top positions, an arithmetic shift sign-extends */
+static __attribute__((target("ssse3"))) void aw_unpack_ssse3_S24_3LE (char* p_src, int32_t* p_dst, size_t nsamples)
 {
-    int err;
-    int plug_i;
-    int card_i;
-    int dev_i;
-    int i;
-    uint8_t nchannels;
-    int framerate_i;
-    int format_i;
-    snd_pcm_stream_t mode;
-    char card_name[32];
-    char dev_name[32];
-    char plug_dev_name[32];
-    char* card_human_name = NULL;
-    char* card_human_longname = NULL;
-    snd_ctl_t* p_ctl;
-    snd_pcm_t* p_pcm;
-    snd_pcm_hw_params_t* p_hw_params;
-    int dir;
-    uint32_t min, max;
-    snd_pcm_format_t fmt;
+    const __m128i shuffle = _mm_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i = 0;
 
-    *p_aw_pcms_length = 0;
+    /* 16 byte loads consume 12, stop while 4 bytes of slack remain */
+    for (; i + 6 <= nsamples; i += 4)
+        _mm_storeu_si128 ((__m128i*) (p_dst + i), 
+                          _mm_srai_epi32 (_mm_shuffle_epi8 (_mm_loadu_si128 ((__m128i*) (p_src + 3 * i)), shuffle), 8));
 
-    if ((err = snd_pcm_hw_params_malloc (&p_hw_params)) < 0)
-        return aw_handle_err (snd_strerror(err));                
+    aw_unpack_S24_3LE (p_src + 3 * i, p_dst + i, nsamples - i);
+}
 
-    card_i = -1;
-    
-    while (1)
+static __attribute__((target("avx2"))) void aw_unpack_avx2_S24_3LE (char* p_src, int32_t* p_dst, size_t nsamples)
+{
+    const __m256i shuffle = _mm256_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                              -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256i v;
+    size_t i = 0;
+
+    /* 8 samples from two 16 byte loads at +0 and +12 */
+    for (; i + 10 <= nsamples; i += 8)
     {
-        if ((err = snd_card_next (&card_i)) < 0 || card_i < 0) break;
-        
-        snd_card_get_name(card_i, &card_human_name);
-        snd_card_get_longname(card_i, &card_human_longname);   
+        v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((__m128i*) (p_src + 3 * i))),
+                                     _mm_loadu_si128 ((__m128i*) (p_src + 3 * i + 12)), 1);
+        _mm256_storeu_si256 ((__m256i*) (p_dst + i), _mm256_srai_epi32 (_mm256_shuffle_epi8 (v, shuffle), 8));
+    }
+    aw_unpack_S24_3LE (p_src + 3 * i, p_dst + i, nsamples - i);
+}
 
-        sprintf(card_name, "hw:%d", card_i);
+#endif
 
-        if ((err = snd_ctl_open(&p_ctl, card_name, 0)) < 0 || card_i < 0) continue;  
-        
-        dev_i = -1;
 
-        while (1)
-        {
-            if ((err = snd_ctl_pcm_next_device (p_ctl, &dev_i)) < 0 || dev_i < 0) break;
-            
-            snprintf(dev_name, sizeof dev_name, "hw:%d,%d", card_i, dev_i);  
-            snprintf(plug_dev_name, sizeof dev_name, "plughw:%d,%d", card_i, dev_i);   
-            
-            mode = SND_PCM_STREAM_CAPTURE;
+/*============================================================================
+                metering kernels
+============================================================================*/
 
-            while (1)
-            {
-                if ((err = snd_pcm_open (&p_pcm, dev_name, mode, SND_PCM_ASYNC)) == 0)
-                {   
-                    if ((err = snd_pcm_hw_params_any (p_pcm, p_hw_params)) < 0)
-                        continue;
-                        
-                    aw_pcms[*p_aw_pcms_length].mode = mode;
-
-                    if ((err = snd_pcm_hw_params_get_channels_min (p_hw_params, &min)) < 0) 
-                        continue;
-                        
-                    if ((err = snd_pcm_hw_params_get_channels_max (p_hw_params, &max)) < 0)
-                        continue;
-                        
-                    i = 0;                        
-                    for (nchannels = min; nchannels <= max; nchannels++)
-                    
-                        if ((err = snd_pcm_hw_params_test_channels (p_pcm, p_hw_params, nchannels)) == 0)
-                        {
-                            aw_pcms[*p_aw_pcms_length].nchannels[i] = nchannels;
-                            i++;                     
-                        }
-                    if (i == 0) continue;
-                    
-                    aw_pcms[*p_aw_pcms_length].nchannels[i] = -1;
-                    
-                    if ((err = snd_pcm_hw_params_get_rate_min ( p_hw_params, &min, &dir)) < 0) 
-                        continue;
-                        
-                    if ((err = snd_pcm_hw_params_get_rate_max (p_hw_params, &max, &dir)) < 0)
-                        continue;
-                    
-                    i = 0;
-                    for (framerate_i = 0; framerate_i < AW_POPULAR_FRAMERATES_LENGTH; framerate_i++)
-
-                        if (AW_POPULAR_FRAMERATES[framerate_i] >= min && AW_POPULAR_FRAMERATES[framerate_i] <= max)
-                        
-                            if ((err = snd_pcm_hw_params_test_rate (p_pcm, p_hw_params, AW_POPULAR_FRAMERATES[framerate_i], 0)) == 0)
-                            {
-                                aw_pcms[*p_aw_pcms_length].framerates[i] = AW_POPULAR_FRAMERATES[framerate_i];
-                                i++;
-                            }   
-                    if (i == 0) continue;                    
-                    aw_pcms[*p_aw_pcms_length].framerates[i] = -1;
-
-                    i = 0;
-                    for (format_i = 0; format_i < AW_POPULAR_FORMATS_LENGTH; format_i++)
-                    {
-                        if ((err = snd_pcm_hw_params_test_format (p_pcm, p_hw_params, AW_POPULAR_FORMATS[format_i])) == 0)
-                        {
-                            aw_pcms[*p_aw_pcms_length].formats[i] = AW_POPULAR_FORMATS[format_i];
-                            i++;
-                        }
-                    }
-                    if (i == 0) continue;
-                    aw_pcms[*p_aw_pcms_length].formats[i] = SND_PCM_FORMAT_UNKNOWN;
-                    
-                    snprintf (aw_pcms[*p_aw_pcms_length].name, sizeof aw_pcms[*p_aw_pcms_length].name, "%s", dev_name);
-                    snprintf (aw_pcms[*p_aw_pcms_length].cardname, sizeof aw_pcms[*p_aw_pcms_length].cardname, "%s", card_human_name);
-                    snprintf (aw_pcms[*p_aw_pcms_length].cardlongname, sizeof aw_pcms[*p_aw_pcms_length].cardlongname, "%s", card_human_longname);
-                    
-                    if ((err = snd_pcm_close (p_pcm)) < 0) 
-                        continue;
-                }
-                
-                if ((err = snd_pcm_open (&p_pcm, plug_dev_name, mode, SND_PCM_ASYNC)) == 0)
-                {
-                    if (snd_pcm_hw_params_any (p_pcm, p_hw_params) == 0 &&                        
-                        snd_pcm_hw_params_test_channels (p_pcm, p_hw_params, AW_DEFAULT_NCHANNELS) == 0 &&
-                        snd_pcm_hw_params_test_rate (p_pcm, p_hw_params, AW_DEFAULT_FRAMERATE, 0) == 0 &&
-                        snd_pcm_hw_params_test_format (p_pcm, p_hw_params, AW_DEFAULT_FORMAT) == 0)
-                    {
-                        aw_pcms[*p_aw_pcms_length].has_plughw = 1;
 
-                    } else {
+/*
+ * one kernel per format and common channel count, chosen once by aw_set_params.
+ * kernels accumulate the peak magnitude and the sum of squared (magnitude >> shift)
+ * per channel over at most AW_KERNEL_BLOCK frames, so the 64 bit sums cannot overflow.
+ * all kernels walk the interleaved buffer once, frame by frame, whatever the channel count.
+*/
 
-                        aw_pcms[*p_aw_pcms_length].has_plughw = 0;
-                    }
+#define AW_MAGNITUDE(value) ((value) < 0 ? -(uint32_t) (value) : (uint32_t) (value))
+
+#define AW_METER_KERNEL(FORMAT, SAMPLESIZE, SHIFT, NCHANNELS)                                       \
+static void aw_kernel_##FORMAT##_##NCHANNELS (char* p_buffer, snd_pcm_uframes_t nframes,           \
+                                              uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs) \
+{                                                                                                   \
+    snd_pcm_uframes_t frame_i;                                                                      \
+    int channel_i;                                                                                  \
+    uint32_t mag;                                                                                   \
+    uint32_t peaks[NCHANNELS] = {0};                                                                \
+    uint64_t sumsqs[NCHANNELS] = {0};                                                               \
+    char* p_sample = p_buffer;                                                                      \
+                                                                                                    \
+    for (frame_i = 0; frame_i < nframes; frame_i++)                                                 \
+    {                                                                                               \
+        for (channel_i = 0; channel_i < NCHANNELS; channel_i++)                                     \
+        {                                                                                           \
+            mag = AW_MAGNITUDE (AW_LOAD_##FORMAT (p_sample));                                       \
+            p_sample += SAMPLESIZE;                                                                 \
+            if (mag > peaks[channel_i]) peaks[channel_i] = mag;                                     \
+            mag >>= SHIFT;                                                                          \
+            sumsqs[channel_i] += (uint64_t) mag * mag;                                              \
+        }                                                                                           \
+    }                                                                                               \
+    for (channel_i = 0; channel_i < NCHANNELS; channel_i++)                                         \
+    {                                                                                               \
+        if (peaks[channel_i] > p_peaks[channel_i]) p_peaks[channel_i] = peaks[channel_i];           \
+        p_sumsqs[channel_i] += sumsqs[channel_i];                                                   \
+    }                                                                                               \
+}
 
-                    if ((err = snd_pcm_close (p_pcm)) < 0) 
-                        ;
+#define AW_METER_KERNEL_N(FORMAT, SAMPLESIZE, SHIFT)                                                \
+static void aw_kernel_##FORMAT##_n (char* p_buffer, snd_pcm_uframes_t nframes,                     \
+                                    uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs)      \
+{                                                                                                   \
+    snd_pcm_uframes_t frame_i;                                                                      \
+    int channel_i;                                                                                  \
+    uint32_t mag;                                                                                   \
+    char* p_sample = p_buffer;                                                                      \
+                                                                                                    \
+    for (frame_i = 0; frame_i < nframes; frame_i++)                                                 \
+    {                                                                                               \
+        for (channel_i = 0; channel_i < nchannels; channel_i++)                                     \
+        {                                                                                           \
+            mag = AW_MAGNITUDE (AW_LOAD_##FORMAT (p_sample));                                       \
+            p_sample += SAMPLESIZE;                                                                 \
+            if (mag > p_peaks[channel_i]) p_peaks[channel_i] = mag;                                 \
+            mag >>= SHIFT;                                                                          \
+            p_sumsqs[channel_i] += (uint64_t) mag * mag;                                            \
+        }                                                                                           \
+    }                                                                                               \
+}
 
-                } else {
+#define AW_METER_KERNELS(FORMAT, SAMPLESIZE, SHIFT)                                                 \
+    AW_METER_KERNEL (FORMAT, SAMPLESIZE, SHIFT, 1)                                                  \
+    AW_METER_KERNEL (FORMAT, SAMPLESIZE, SHIFT, 2)                                                  \
+    AW_METER_KERNEL (FORMAT, SAMPLESIZE, SHIFT, 4)                                                  \
+    AW_METER_KERNEL (FORMAT, SAMPLESIZE, SHIFT, 8)                                                  \
+    AW_METER_KERNEL_N (FORMAT, SAMPLESIZE, SHIFT)
 
-                    aw_pcms[*p_aw_pcms_length].has_plughw = 0;
-                }
+AW_METER_KERNELS (S8, 1, 0)
+AW_METER_KERNELS (S16_LE, 2, 0)
+AW_METER_KERNELS (S24_LE, 4, 0)
+AW_METER_KERNELS (S24_3LE, 3, 0)
+AW_METER_KERNELS (S32_LE, 4, AW_S32_SUMSQ_SHIFT)
 
-                if (mode == SND_PCM_STREAM_PLAYBACK)
-                    break;
-                else
-                    mode = SND_PCM_STREAM_PLAYBACK;
+/*
+ * vectorized kernels: samples are widened to 32 bit lanes, a block of lcm(framesize, vector bytes)
+ * keeps every lane on a fixed channel, sums are exact 64 bit integers so results equal the scalar ones
+*/
 
-                (*p_aw_pcms_length)++;                    
-            }
-        }
-        snd_ctl_close(p_ctl);
+#if defined(__x86_64__) || defined(__i386__)
+
+#define AW_SIMD_MAX_VECTORS 32
+
+static size_t aw_gcd (size_t a, size_t b)
+{
+    size_t t;
+
+    while (b != 0)
+    {
+        t = a % b;
+        a = b;
+        b = t;
     }
-    snd_pcm_hw_params_free (p_hw_params);
-    
-    return 0;
+    return a;
 }
 
-int aw_print_pcms (AwPcm aw_pcms[], uint8_t aw_pcms_length)
+static void aw_simd_reduce (uint32_t* lane_peaks, uint64_t* lane_sumsqs, int nlanes, int nvectors, uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs)
 {
     int i;
-    int j;
+    int channel_i;
 
-    printf("There are %d pcms\n", aw_pcms_length);
+    for (i = 0; i < nlanes * nvectors; i++)
+    {
+        channel_i = i % nchannels;
+        if (lane_peaks[i] > p_peaks[channel_i]) p_peaks[channel_i] = lane_peaks[i];
+        p_sumsqs[channel_i] += lane_sumsqs[i];
+    }
+}
 
-    for (i = 0; i < aw_pcms_length; i++)
+static inline __attribute__((always_inline, target("sse2"))) __m128i aw_sse2_load (char* p, int samplesize, int sign_extend_24)
+{
+    __m128i v;
+
+    if (samplesize == 1)
     {
-        printf("\nPCM: %s\n", (*(aw_pcms + i)).name);
-        printf("\n    card name: %s", (*(aw_pcms + i)).cardname);
-        printf("\n    card long name: %s", (*(aw_pcms + i)).cardlongname);
-        printf("\n    has plughw: %s\n", (*(aw_pcms + i)).has_plughw ? "true" : "false");
+        v = _mm_cvtsi32_si128 (*((int32_t*) p));
+        v = _mm_unpacklo_epi8 (v, v);
+        return _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 24);
 
-        if ((*(aw_pcms + i)).mode == SND_PCM_STREAM_PLAYBACK) 
-            printf("    mode:  playback");
-        else
-            printf("    mode:  capture");
-        
-        printf("\n    nchannels:  ");
-        j = 0;
-        while ((*(aw_pcms + i)).nchannels[j] != -1)
-        {
-            printf("%d  ", (*(aw_pcms + i)).nchannels[j]);
-            j++;
-        }       
+    } else if (samplesize == 2) {
 
-        printf("\n    framerates:  ");
-        j = 0;
-        while ((*(aw_pcms + i)).framerates[j] != -1)
-        {
-            printf("%d  ", (*(aw_pcms + i)).framerates[j]);
-            j++;
-        }       
+        v = _mm_loadl_epi64 ((__m128i*) p);
+        return _mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16);
+    }
+    v = _mm_loadu_si128 ((__m128i*) p);
 
-        printf("\n    formats:  ");
-        j = 0;
-        while ((*(aw_pcms + i)).formats[j] != SND_PCM_FORMAT_UNKNOWN)
+    return sign_extend_24 ? _mm_srai_epi32 (_mm_slli_epi32 (v, 8), 8) : v;
+}
+
+static inline __attribute__((always_inline, target("sse2"))) void aw_sse2_meter (char* p_buffer, snd_pcm_uframes_t nframes, uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs, 
+                                                                                  int samplesize, int sign_extend_24, int shift, 
+                                                                                  void (*p_tail) (char*, snd_pcm_uframes_t, uint8_t, uint32_t*, uint64_t*))
+{
+    const int vector_bytes = 4 * samplesize;
+    size_t framesize = (size_t) nchannels * samplesize;
+    size_t block_bytes = framesize / aw_gcd (framesize, vector_bytes) * vector_bytes;
+    int nvectors = block_bytes / vector_bytes;
+    snd_pcm_uframes_t nblocks = nframes / (block_bytes / framesize);
+    snd_pcm_uframes_t block_i;
+    int k;
+    char* p_sample = p_buffer;
+    __m128i peaks[AW_SIMD_MAX_VECTORS];
+    __m128i evens[AW_SIMD_MAX_VECTORS];
+    __m128i odds[AW_SIMD_MAX_VECTORS];
+    __m128i bias = _mm_set1_epi32 (INT32_MIN);
+    __m128i v, sign, mag, greater, half;
+    uint32_t lane_peaks[4 * AW_SIMD_MAX_VECTORS];
+    uint64_t lane_sumsqs[4 * AW_SIMD_MAX_VECTORS];
+    uint64_t even_lanes[2], odd_lanes[2];
+
+    if (nvectors > AW_SIMD_MAX_VECTORS)
+    {
+        (*p_tail) (p_buffer, nframes, nchannels, p_peaks, p_sumsqs);
+        return;
+    }
+    for (k = 0; k < nvectors; k++)
+    {
+        peaks[k] = _mm_setzero_si128 ();
+        evens[k] = _mm_setzero_si128 ();
+        odds[k] = _mm_setzero_si128 ();
+    }
+    for (block_i = 0; block_i < nblocks; block_i++)
+    {
+        for (k = 0; k < nvectors; k++)
         {
-            printf("%s (%s)  ", snd_pcm_format_name((*(aw_pcms + i)).formats[j]), snd_pcm_format_description((*(aw_pcms + i)).formats[j]));
-            j++;
-        }       
-        printf("\n"); 
+            v = aw_sse2_load (p_sample, samplesize, sign_extend_24);
+            p_sample += vector_bytes;
+
+            sign = _mm_srai_epi32 (v, 31);
+            mag = _mm_sub_epi32 (_mm_xor_si128 (v, sign), sign);
+
+            /* unsigned max through biased signed compare */
+            greater = _mm_cmpgt_epi32 (_mm_xor_si128 (mag, bias), _mm_xor_si128 (peaks[k], bias));
+            peaks[k] = _mm_or_si128 (_mm_and_si128 (greater, mag), _mm_andnot_si128 (greater, peaks[k]));
+
+            mag = _mm_srli_epi32 (mag, shift);
+            half = _mm_srli_epi64 (mag, 32);
+            evens[k] = _mm_add_epi64 (evens[k], _mm_mul_epu32 (mag, mag));
+            odds[k] = _mm_add_epi64 (odds[k], _mm_mul_epu32 (half, half));
+        }
     }
-    return 0;
+    for (k = 0; k < nvectors; k++)
+    {
+        _mm_storeu_si128 ((__m128i*) (lane_peaks + 4 * k), peaks[k]);
+        _mm_storeu_si128 ((__m128i*) even_lanes, evens[k]);
+        _mm_storeu_si128 ((__m128i*) odd_lanes, odds[k]);
+        lane_sumsqs[4 * k] = even_lanes[0];
+        lane_sumsqs[4 * k + 1] = odd_lanes[0];
+        lane_sumsqs[4 * k + 2] = even_lanes[1];
+        lane_sumsqs[4 * k + 3] = odd_lanes[1];
+    }
+    aw_simd_reduce (lane_peaks, lane_sumsqs, 4, nvectors, nchannels, p_peaks, p_sumsqs);
+
+    if (nframes > nblocks * (block_bytes / framesize))
+        (*p_tail) (p_sample, nframes - nblocks * (block_bytes / framesize), nchannels, p_peaks, p_sumsqs);
 }
 
-int aw_print_pcm (AwPcm* p_aw_pcm) 
+static inline __attribute__((always_inline, target("avx2"))) __m256i aw_avx2_load (char* p, int samplesize, int sign_extend_24)
 {
-    int j;
-    
-    printf("\nPCM: %s\n", (*p_aw_pcm).name);
-    printf("\n    card name: %s", (*p_aw_pcm).cardname);
-    printf("\n    card long name: %s", (*p_aw_pcm).cardlongname);
-    printf("\n    has plughw: %s\n", (*p_aw_pcm).has_plughw ? "true" : "false");
-    
-    if ((*p_aw_pcm).mode == SND_PCM_STREAM_PLAYBACK) 
-        printf("    mode:  playback");
-    else
-        printf("    mode:  capture");
-        
-    printf("\n    nchannels:  ");
-    j = 0;
-    while ((*p_aw_pcm).nchannels[j] != -1 && j < 100)
+    __m256i v;
+
+    if (samplesize == 1)
+        return _mm256_cvtepi8_epi32 (_mm_loadl_epi64 ((__m128i*) p));
+    else if (samplesize == 2)
+        return _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((__m128i*) p));
+
+    v = _mm256_loadu_si256 ((__m256i*) p);
+
+    return sign_extend_24 ? _mm256_srai_epi32 (_mm256_slli_epi32 (v, 8), 8) : v;
+}
+
+static inline __attribute__((always_inline, target("avx2"))) void aw_avx2_meter (char* p_buffer, snd_pcm_uframes_t nframes, uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs, 
+                                                                                  int samplesize, int sign_extend_24, int shift, 
+                                                                                  void (*p_tail) (char*, snd_pcm_uframes_t, uint8_t, uint32_t*, uint64_t*))
+{
+    const int vector_bytes = 8 * samplesize;
+    size_t framesize = (size_t) nchannels * samplesize;
+    size_t block_bytes = framesize / aw_gcd (framesize, vector_bytes) * vector_bytes;
+    int nvectors = block_bytes / vector_bytes;
+    snd_pcm_uframes_t nblocks = nframes / (block_bytes / framesize);
+    snd_pcm_uframes_t block_i;
+    int k;
+    int i;
+    char* p_sample = p_buffer;
+    __m256i peaks[AW_SIMD_MAX_VECTORS];
+    __m256i evens[AW_SIMD_MAX_VECTORS];
+    __m256i odds[AW_SIMD_MAX_VECTORS];
+    __m256i v, mag, half;
+    uint32_t lane_peaks[8 * AW_SIMD_MAX_VECTORS];
+    uint64_t lane_sumsqs[8 * AW_SIMD_MAX_VECTORS];
+    uint64_t even_lanes[4], odd_lanes[4];
+
+    if (nvectors > AW_SIMD_MAX_VECTORS)
     {
-        printf("%d  ", (*p_aw_pcm).nchannels[j]);
-        j++;
-    }     
-    printf("\n    framerates:  ");
-    j = 0;
-    while ((*p_aw_pcm).framerates[j] != -1)
+        (*p_tail) (p_buffer, nframes, nchannels, p_peaks, p_sumsqs);
+        return;
+    }
+    for (k = 0; k < nvectors; k++)
     {
-        printf("%d  ", (*p_aw_pcm).framerates[j]);
-        j++;
-    }       
-    printf("\n    formats:  ");
-    j = 0;
-    while ((*p_aw_pcm).formats[j] != SND_PCM_FORMAT_UNKNOWN)
+        peaks[k] = _mm256_setzero_si256 ();
+        evens[k] = _mm256_setzero_si256 ();
+        odds[k] = _mm256_setzero_si256 ();
+    }
+    for (block_i = 0; block_i < nblocks; block_i++)
     {
-        printf("%s (%s)  ", snd_pcm_format_name((*p_aw_pcm).formats[j]), snd_pcm_format_description((*p_aw_pcm).formats[j]));
-        j++;
-    }       
-    printf("\n"); 
+        for (k = 0; k < nvectors; k++)
+        {
+            v = aw_avx2_load (p_sample, samplesize, sign_extend_24);
+            p_sample += vector_bytes;
 
-    return 0;
+            mag = _mm256_abs_epi32 (v);
+            peaks[k] = _mm256_max_epu32 (peaks[k], mag);
+
+            mag = _mm256_srli_epi32 (mag, shift);
+            half = _mm256_srli_epi64 (mag, 32);
+            evens[k] = _mm256_add_epi64 (evens[k], _mm256_mul_epu32 (mag, mag));
+            odds[k] = _mm256_add_epi64 (odds[k], _mm256_mul_epu32 (half, half));
+        }
+    }
+    for (k = 0; k < nvectors; k++)
+    {
+        _mm256_storeu_si256 ((__m256i*) (lane_peaks + 8 * k), peaks[k]);
+        _mm256_storeu_si256 ((__m256i*) even_lanes, evens[k]);
+        _mm256_storeu_si256 ((__m256i*) odd_lanes, odds[k]);
+
+        for (i = 0; i < 4; i++)
+        {
+            lane_sumsqs[8 * k + 2 * i] = even_lanes[i];
+            lane_sumsqs[8 * k + 2 * i + 1] = odd_lanes[i];
+        }
+    }
+    aw_simd_reduce (lane_peaks, lane_sumsqs, 8, nvectors, nchannels, p_peaks, p_sumsqs);
+
+    if (nframes > nblocks * (block_bytes / framesize))
+        (*p_tail) (p_sample, nframes - nblocks * (block_bytes / framesize), nchannels, p_peaks, p_sumsqs);
 }
 
+#define AW_SIMD_KERNEL(ISA, FORMAT, SAMPLESIZE, SIGN_EXTEND_24, SHIFT)                              \
+static __attribute__((target(#ISA))) void aw_kernel_##ISA##_##FORMAT (char* p_buffer,              \
+    snd_pcm_uframes_t nframes, uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs)           \
+{                                                                                                   \
+    aw_##ISA##_meter (p_buffer, nframes, nchannels, p_peaks, p_sumsqs,                              \
+                      SAMPLESIZE, SIGN_EXTEND_24, SHIFT, &aw_kernel_##FORMAT##_n);                  \
+}
 
-/*============================================================================
-                pcm parameters
-============================================================================*/
+#define AW_SIMD_KERNELS(ISA)                                                                        \
+    AW_SIMD_KERNEL (ISA, S8, 1, 0, 0)                                                               \
+    AW_SIMD_KERNEL (ISA, S16_LE, 2, 0, 0)                                                           \
+    AW_SIMD_KERNEL (ISA, S24_LE, 4, 1, 0)                                                           \
+    AW_SIMD_KERNEL (ISA, S32_LE, 4, 0, AW_S32_SUMSQ_SHIFT)
+
+AW_SIMD_KERNELS (sse2)
+AW_SIMD_KERNELS (avx2)
+
+/* packed 24 bit goes through the bulk unpacker and then the 32 bit container kernel */
+#define AW_UNPACK_KERNEL(NAME, UNPACK, KERNEL, TARGET)                                              \
+static __attribute__((target(TARGET))) void NAME (char* p_buffer, snd_pcm_uframes_t nframes,       \
+    uint8_t nchannels, uint32_t* p_peaks, uint64_t* p_sumsqs)                                      \
+{                                                                                                   \
+    int32_t samples[AW_UNPACK_CHUNK];                                                               \
+    snd_pcm_uframes_t chunk = AW_UNPACK_CHUNK / nchannels;                                          \
+    snd_pcm_uframes_t n;                                                                            \
+                                                                                                    \
+    while (nframes > 0)                                                                             \
+    {                                                                                               \
+        n = nframes < chunk ? nframes : chunk;                                                      \
+        UNPACK (p_buffer, samples, n * nchannels);                                                  \
+        KERNEL ((char*) samples, n, nchannels, p_peaks, p_sumsqs);                                  \
+        p_buffer += n * nchannels * 3;                                                              \
+        nframes -= n;                                                                               \
+    }                                                                                               \
+}
 
+AW_UNPACK_KERNEL (aw_kernel_sse2_S24_3LE, aw_unpack_S24_3LE, aw_kernel_sse2_S24_LE, "sse2")
+AW_UNPACK_KERNEL (aw_kernel_ssse3_S24_3LE, aw_unpack_ssse3_S24_3LE, aw_kernel_sse2_S24_LE, "ssse3")
+AW_UNPACK_KERNEL (aw_kernel_avx2_S24_3LE, aw_unpack_avx2_S24_3LE, aw_kernel_avx2_S24_LE, "avx2")
 
-int aw_set_params (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params)
+#define AW_SIMD_SWITCH(ISA)                                                                         \
+    if ((*p_params).format == SND_PCM_FORMAT_S8) (*p_params).p_kernel = &aw_kernel_##ISA##_S8;      \
+    else if ((*p_params).format == SND_PCM_FORMAT_S16_LE) (*p_params).p_kernel = &aw_kernel_##ISA##_S16_LE; \
+    else if ((*p_params).format == SND_PCM_FORMAT_S24_LE) (*p_params).p_kernel = &aw_kernel_##ISA##_S24_LE; \
+    else if ((*p_params).format == SND_PCM_FORMAT_S32_LE) (*p_params).p_kernel = &aw_kernel_##ISA##_S32_LE; \
+    else if ((*p_params).format == SND_PCM_FORMAT_S24_3LE) (*p_params).p_kernel = &aw_kernel_##ISA##_S24_3LE;
+
+aw_isa_t aw_detect_isa ()
 {
-    int err;
-    int dir = 0;
-    snd_pcm_hw_params_t* p_alsa_hw_params;
-    unsigned int period_time = AW_DEFAULT_PERIOD_TIME;
-    
-    if ((err = snd_pcm_hw_params_malloc (&p_alsa_hw_params)) < 0)
-        return aw_handle_err (snd_strerror (err));
-    
-    if ((err = snd_pcm_hw_params_any (p_pcm, p_alsa_hw_params)) < 0)
-        return aw_handle_err (snd_strerror (err));
-    
-    if ((err = snd_pcm_hw_params_set_access (p_pcm, p_alsa_hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
-        return aw_handle_err (snd_strerror (err));
-    
-    if ((err = snd_pcm_hw_params_set_format (p_pcm, p_alsa_hw_params, (*p_hw_params).format)) < 0)
-        return aw_handle_err (snd_strerror (err));
+    __builtin_cpu_init ();
 
-    if ((err = snd_pcm_hw_params_set_rate (p_pcm, p_alsa_hw_params, (*p_hw_params).framerate, 0)) < 0)
-        return aw_handle_err (snd_strerror (err));
-        
-    if ((err = snd_pcm_hw_params_set_channels (p_pcm, p_alsa_hw_params, (*p_hw_params).nchannels)) < 0)
-        return aw_handle_err (snd_strerror (err));
+    if (__builtin_cpu_supports ("avx2"))
+        return AW_ISA_AVX2;
+    if (__builtin_cpu_supports ("ssse3"))
+        return AW_ISA_SSSE3;
+    if (__builtin_cpu_supports ("sse2"))
+        return AW_ISA_SSE2;
 
-    /* set buffer and period */
-    
-    if ((err = snd_pcm_hw_params_set_period_time_near (p_pcm, p_alsa_hw_params, &period_time, &dir)) < 0)
-        return aw_handle_err (snd_strerror (err));    
-    
-    if (period_time != AW_DEFAULT_PERIOD_TIME)
-        printf ("need adjust period size");
+    return AW_ISA_SCALAR;
+}
 
-	snd_pcm_hw_params_get_period_size (p_alsa_hw_params, &(*p_hw_params).period_size, &dir);    
-	snd_pcm_hw_params_set_buffer_size (p_pcm, p_alsa_hw_params, (*p_hw_params).period_size * AW_DEFAULT_PERIOD_COUNT);
-    snd_pcm_hw_params_get_buffer_size (p_alsa_hw_params, &(*p_hw_params).buffer_size);
+#else
 
-    if ((err = snd_pcm_hw_params (p_pcm, p_alsa_hw_params)) < 0)
-        return aw_handle_err (snd_strerror(err));
+aw_isa_t aw_detect_isa ()
+{
+    return AW_ISA_SCALAR;
+}
 
-    /* complete params */
+#endif
+
+#define AW_KERNEL_SWITCH(FORMAT)                                                                    \
+    (*p_params).p_unpack = &aw_unpack_##FORMAT;                                                     \
+    switch ((*p_params).nchannels)                                                                  \
+    {                                                                                               \
+        case 1: (*p_params).p_kernel = &aw_kernel_##FORMAT##_1; break;                              \
+        case 2: (*p_params).p_kernel = &aw_kernel_##FORMAT##_2; break;                              \
+        case 4: (*p_params).p_kernel = &aw_kernel_##FORMAT##_4; break;                              \
+        case 8: (*p_params).p_kernel = &aw_kernel_##FORMAT##_8; break;                              \
+        default: (*p_params).p_kernel = &aw_kernel_##FORMAT##_n;                                    \
+    }
 
-    if ((*p_hw_params).format == SND_PCM_FORMAT_S8)
+int aw_select_kernel (AwPcmParams* p_params)
+{
+    return aw_select_kernel_isa (p_params, aw_detect_isa ());
+}
+
+int aw_select_kernel_isa (AwPcmParams* p_params, aw_isa_t isa)
+{
+    uint32_t sumsq_shift = 0;
+
+    if ((*p_params).format == SND_PCM_FORMAT_S8)
     {
-        (*p_hw_params).p_parser = &aw_parser_S8;
+        AW_KERNEL_SWITCH (S8)
 
-    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S16_LE) {
+    } else if ((*p_params).format == SND_PCM_FORMAT_S16_LE) {
 
-        (*p_hw_params).p_parser = &aw_parser_S16_LE;
-    
-    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S24_3LE) {
+        AW_KERNEL_SWITCH (S16_LE)
 
-        (*p_hw_params).p_parser = &aw_parser_S24_3LE;
-    
-    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S24_LE) {
+    } else if ((*p_params).format == SND_PCM_FORMAT_S24_3LE) {
+
+        AW_KERNEL_SWITCH (S24_3LE)
+
+    } else if ((*p_params).format == SND_PCM_FORMAT_S24_LE) {
+
+        AW_KERNEL_SWITCH (S24_LE)
+
+    } else if ((*p_params).format == SND_PCM_FORMAT_S32_LE) {
+
+        AW_KERNEL_SWITCH (S32_LE)
+        sumsq_shift = AW_S32_SUMSQ_SHIFT;
 
-        (*p_hw_params).p_parser = &aw_parser_S32_LE;
-    
-    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S32_LE) {
-        
-        (*p_hw_params).p_parser = &aw_parser_S32_LE;
-    
     } else {
 
-        (*p_hw_params).p_parser = NULL;
-        return aw_handle_err ("format not recognized");
+        (*p_params).p_kernel = NULL;
+        (*p_params).p_unpack = NULL;
+        return aw_handle_err ("no metering kernel for format");
     }
 
-    (*p_hw_params).nominal_bits = snd_pcm_format_width ((*p_hw_params).format);
-    (*p_hw_params).real_bits = snd_pcm_format_physical_width ((*p_hw_params).format);
-    (*p_hw_params).max = pow (2, (*p_hw_params).nominal_bits) / 2;
-    (*p_hw_params).samplesize = (*p_hw_params).real_bits / 8;
-    (*p_hw_params).samplerate = (*p_hw_params).nchannels * (*p_hw_params).framerate;    
-    (*p_hw_params).framesize = (*p_hw_params).nchannels * (*p_hw_params).samplesize;
-    (*p_hw_params).byterate = (*p_hw_params).samplerate * (*p_hw_params).samplesize;
-    snprintf((*p_hw_params).description, sizeof (*p_hw_params).description, "channels %d framerate %d format %s (%s)", (*p_hw_params).nchannels, (*p_hw_params).framerate, snd_pcm_format_name((*p_hw_params).format), snd_pcm_format_description((*p_hw_params).format));
+#if defined(__x86_64__) || defined(__i386__)
+
+    if (isa == AW_ISA_AVX2)
+    {
+        AW_SIMD_SWITCH (avx2)
+
+        if ((*p_params).format == SND_PCM_FORMAT_S24_3LE)
+            (*p_params).p_unpack = &aw_unpack_avx2_S24_3LE;
+
+    } else if (isa == AW_ISA_SSSE3) {
+
+        AW_SIMD_SWITCH (sse2)
+
+        if ((*p_params).format == SND_PCM_FORMAT_S24_3LE)
+        {
+            (*p_params).p_kernel = &aw_kernel_ssse3_S24_3LE;
+            (*p_params).p_unpack = &aw_unpack_ssse3_S24_3LE;
+        }
+
+    } else if (isa == AW_ISA_SSE2) {
+
+        AW_SIMD_SWITCH (sse2)
+    }
+
+#endif
+
+    /* scale kernel sums of squares back to (100 * sample / max)^2 units */
+    (*p_params).power_scale = pow (2, 2 * sumsq_shift) * 10000.0 / ((double) (*p_params).max * (*p_params).max);
+
+    return 0;
+}
+
+
+/*============================================================================
+                cards, pcms, confs
+============================================================================*/
+
+
+/* capture devices of a card, named but not probed: only the control device is opened */
+int aw_list_card (int card_i, AwPcm aw_pcms[], uint8_t* p_aw_pcms_length)
+{
+    int err;
+    int dev_i = -1;
+    char card_name[32];
+    char* card_human_name = NULL;
+    char* card_human_longname = NULL;
+    snd_ctl_t* p_ctl;
+    snd_pcm_info_t* p_info;
+    AwPcm* p_aw_pcm;
+
+    snprintf (card_name, sizeof card_name, "hw:%d", card_i);
+
+    if ((err = snd_pcm_info_malloc (&p_info)) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    if ((err = snd_ctl_open (&p_ctl, card_name, 0)) < 0)
+    {
+        snd_pcm_info_free (p_info);
+        return aw_handle_err (snd_strerror (err));
+    }
+    snd_card_get_name (card_i, &card_human_name);
+    snd_card_get_longname (card_i, &card_human_longname);   
+
+    while (*p_aw_pcms_length < AW_MAX_PCMS_LENGTH && snd_ctl_pcm_next_device (p_ctl, &dev_i) == 0 && dev_i >= 0)
+    {
+        snd_pcm_info_set_device (p_info, dev_i);
+        snd_pcm_info_set_subdevice (p_info, 0);
+        snd_pcm_info_set_stream (p_info, SND_PCM_STREAM_CAPTURE);
+
+        if (snd_ctl_pcm_info (p_ctl, p_info) < 0)
+            continue;
+
+        p_aw_pcm = &aw_pcms[*p_aw_pcms_length];
+        memset (p_aw_pcm, 0, sizeof (AwPcm));
+
+        (*p_aw_pcm).mode = SND_PCM_STREAM_CAPTURE;
+        (*p_aw_pcm).card = card_i;
+        (*p_aw_pcm).nchannels[0] = -1;
+        (*p_aw_pcm).framerates[0] = -1;
+        (*p_aw_pcm).formats[0] = SND_PCM_FORMAT_UNKNOWN;
+        snprintf ((*p_aw_pcm).name, sizeof (*p_aw_pcm).name, "hw:%d,%d", card_i, dev_i);
+        snprintf ((*p_aw_pcm).cardname, sizeof (*p_aw_pcm).cardname, "%s", card_human_name != NULL ? card_human_name : card_name);
+        snprintf ((*p_aw_pcm).cardlongname, sizeof (*p_aw_pcm).cardlongname, "%s", card_human_longname != NULL ? card_human_longname : card_name);
+
+        (*p_aw_pcms_length)++;
+    }
+    free (card_human_name);
+    free (card_human_longname);
+    snd_ctl_close (p_ctl);
+    snd_pcm_info_free (p_info);
+
+    return 0;
+}
+
+/* fill the capabilities of a listed device; it counts as probed also when it cannot be opened */
+int aw_probe_pcm (AwPcm* p_aw_pcm)
+{
+    int err;
+    int i;
+    int dir;
+    uint8_t nchannels;
+    int framerate_i;
+    int format_i;
+    char plug_dev_name[sizeof (*p_aw_pcm).name + sizeof "plug"];
+    snd_pcm_t* p_pcm;
+    snd_pcm_hw_params_t* p_hw_params;
+    snd_pcm_hw_params_t* p_rate_params;
+    uint32_t min, max;
+
+    (*p_aw_pcm).probed = 1;
+
+    if ((err = snd_pcm_hw_params_malloc (&p_hw_params)) < 0)
+        return aw_handle_err (snd_strerror(err));                
+
+    if ((err = snd_pcm_hw_params_malloc (&p_rate_params)) < 0)
+    {
+        snd_pcm_hw_params_free (p_hw_params);
+        return aw_handle_err (snd_strerror(err));                
+    }
+    if ((err = snd_pcm_open (&p_pcm, (*p_aw_pcm).name, SND_PCM_STREAM_CAPTURE, SND_PCM_ASYNC)) == 0)
+    {   
+        if (snd_pcm_hw_params_any (p_pcm, p_hw_params) >= 0 &&
+            snd_pcm_hw_params_get_channels_min (p_hw_params, &min) >= 0 &&
+            snd_pcm_hw_params_get_channels_max (p_hw_params, &max) >= 0)
+        {
+            i = 0;                        
+            for (nchannels = min; nchannels <= max && nchannels >= min && i < AW_MAX_NCHANNELS_LENGTH - 1; nchannels++)
+            
+                if (snd_pcm_hw_params_test_channels (p_pcm, p_hw_params, nchannels) == 0)
+                {
+                    (*p_aw_pcm).nchannels[i] = nchannels;
+                    i++;                     
+                }
+            (*p_aw_pcm).nchannels[i] = -1;
+        }
+        if (snd_pcm_hw_params_get_rate_min (p_hw_params, &min, &dir) >= 0 &&
+            snd_pcm_hw_params_get_rate_max (p_hw_params, &max, &dir) >= 0)
+        {
+            i = 0;
+            for (framerate_i = 0; framerate_i < AW_POPULAR_FRAMERATES_LENGTH; framerate_i++)
+
+                if (AW_POPULAR_FRAMERATES[framerate_i] >= min && AW_POPULAR_FRAMERATES[framerate_i] <= max)
+                
+                    if (snd_pcm_hw_params_test_rate (p_pcm, p_hw_params, AW_POPULAR_FRAMERATES[framerate_i], 0) == 0)
+                    {
+                        (*p_aw_pcm).framerates[i] = AW_POPULAR_FRAMERATES[framerate_i];
+
+                        /* period and buffer limits in frames depend on the rate */
+                        snd_pcm_hw_params_copy (p_rate_params, p_hw_params);
+                        snd_pcm_hw_params_set_rate (p_pcm, p_rate_params, AW_POPULAR_FRAMERATES[framerate_i], 0);
+                        snd_pcm_hw_params_get_period_size_min (p_rate_params, &(*p_aw_pcm).period_size_min[i], &dir);
+                        snd_pcm_hw_params_get_period_size_max (p_rate_params, &(*p_aw_pcm).period_size_max[i], &dir);
+                        snd_pcm_hw_params_get_buffer_size_min (p_rate_params, &(*p_aw_pcm).buffer_size_min[i]);
+                        snd_pcm_hw_params_get_buffer_size_max (p_rate_params, &(*p_aw_pcm).buffer_size_max[i]);
+                        i++;
+                    }   
+            (*p_aw_pcm).framerates[i] = -1;
+        }
+        i = 0;
+        for (format_i = 0; format_i < AW_POPULAR_FORMATS_LENGTH; format_i++)
+        {
+            if (snd_pcm_hw_params_test_format (p_pcm, p_hw_params, AW_POPULAR_FORMATS[format_i]) == 0)
+            {
+                (*p_aw_pcm).formats[i] = AW_POPULAR_FORMATS[format_i];
+                i++;
+            }
+        }
+        (*p_aw_pcm).formats[i] = SND_PCM_FORMAT_UNKNOWN;
+        
+        snd_pcm_close (p_pcm);
+    }
+    
+    snprintf (plug_dev_name, sizeof plug_dev_name, "plug%s", (*p_aw_pcm).name);   
+
+    (*p_aw_pcm).has_plughw = 0;
+
+    if (snd_pcm_open (&p_pcm, plug_dev_name, SND_PCM_STREAM_CAPTURE, SND_PCM_ASYNC) == 0)
+    {
+        if (snd_pcm_hw_params_any (p_pcm, p_hw_params) == 0 &&                        
+            snd_pcm_hw_params_test_channels (p_pcm, p_hw_params, AW_DEFAULT_NCHANNELS) == 0 &&
+            snd_pcm_hw_params_test_rate (p_pcm, p_hw_params, AW_DEFAULT_FRAMERATE, 0) == 0 &&
+            snd_pcm_hw_params_test_format (p_pcm, p_hw_params, AW_DEFAULT_FORMAT) == 0)
+            (*p_aw_pcm).has_plughw = 1;
+
+        snd_pcm_close (p_pcm);
+    }
+    snd_pcm_hw_params_free (p_hw_params);
+    snd_pcm_hw_params_free (p_rate_params);
+    
+    if (err < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    return 0;
+}
+
+int aw_probe_card (int card_i, AwPcm aw_pcms[], uint8_t* p_aw_pcms_length)
+{
+    uint8_t i = *p_aw_pcms_length;
+
+    if (aw_list_card (card_i, aw_pcms, p_aw_pcms_length) < 0)
+        return -1;
+
+    for (; i < *p_aw_pcms_length; i++)
+        aw_probe_pcm (&aw_pcms[i]);
+
+    return 0;
+}
+
+int aw_get_pcm_devices (AwPcm aw_pcms[], uint8_t* p_aw_pcms_length)
+{
+    int card_i = -1;
+
+    *p_aw_pcms_length = 0;
+
+    while (snd_card_next (&card_i) == 0 && card_i >= 0)
+        aw_probe_card (card_i, aw_pcms, p_aw_pcms_length);
+
+    return 0;
+}
+
+int aw_get_card (int card_i, AwCard* p_card)
+{
+    int err;
+    char card_name[32];
+    snd_ctl_t* p_ctl;
+    snd_ctl_card_info_t* p_info;
+
+    snprintf (card_name, sizeof card_name, "hw:%d", card_i);
+
+    if ((err = snd_ctl_card_info_malloc (&p_info)) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    if ((err = snd_ctl_open (&p_ctl, card_name, 0)) < 0)
+    {
+        snd_ctl_card_info_free (p_info);
+        return aw_handle_err (snd_strerror (err));
+    }
+    if ((err = snd_ctl_card_info (p_ctl, p_info)) < 0)
+    {
+        snd_ctl_close (p_ctl);
+        snd_ctl_card_info_free (p_info);
+        return aw_handle_err (snd_strerror (err));
+    }
+    memset (p_card, 0, sizeof (AwCard));
+    (*p_card).index = card_i;
+    snprintf ((*p_card).id, sizeof (*p_card).id, "%s", snd_ctl_card_info_get_id (p_info));
+    snprintf ((*p_card).driver, sizeof (*p_card).driver, "%s", snd_ctl_card_info_get_driver (p_info));
+    snprintf ((*p_card).longname, sizeof (*p_card).longname, "%s", snd_ctl_card_info_get_longname (p_info));
+
+    snd_ctl_close (p_ctl);
+    snd_ctl_card_info_free (p_info);
+
+    return 0;
+}
+
+/*
+ * capability cache: magic, version, sizeof (AwPcm), ncards, then per card its AwCard, npcms and AwPcm entries.
+ * a card is probed again only when no cached card has the same index, id, driver and long name;
+ * the file is rewritten when the card set changed.
+ * lazily, cards missing from the cache are only listed, their devices left for aw_probe_pcm.
+*/
+
+static int aw_cache_load (const char* cache_path, AwCard cards[], uint32_t card_npcms[], AwPcm aw_pcms[])
+{
+    FILE* p_f;
+    uint32_t header[4];
+    uint32_t ncards = 0;
+    uint32_t npcms = 0;
+    uint32_t i;
+
+    if ((p_f = fopen (cache_path, "rb")) == NULL)
+        return 0;
+
+    if (fread (header, sizeof header, 1, p_f) != 1 || header[0] != AW_CACHE_MAGIC || header[1] != AW_CACHE_VERSION ||
+        header[2] != sizeof (AwPcm) || header[3] > AW_MAX_CARDS)
+    {
+        fclose (p_f);
+        return 0;
+    }
+    for (i = 0; i < header[3]; i++)
+    {
+        if (fread (&cards[i], sizeof (AwCard), 1, p_f) != 1 || fread (&card_npcms[i], sizeof (uint32_t), 1, p_f) != 1 ||
+            npcms + card_npcms[i] > AW_MAX_PCMS_LENGTH || fread (&aw_pcms[npcms], sizeof (AwPcm), card_npcms[i], p_f) != card_npcms[i])
+            break;
+
+        npcms += card_npcms[i];
+        ncards++;
+    }
+    fclose (p_f);
+
+    /* a truncated file is as good as none */
+    return ncards == header[3] ? ncards : 0;
+}
+
+int aw_save_pcm_devices_cache (AwPcm aw_pcms[], uint8_t aw_pcms_length, const char* cache_path)
+{
+    FILE* p_f;
+    char tmp_path[512];
+    AwCard cards[AW_MAX_CARDS];
+    uint32_t card_npcms[AW_MAX_CARDS];
+    uint8_t order[AW_MAX_PCMS_LENGTH]; // entries grouped by card
+    uint32_t header[4] = { AW_CACHE_MAGIC, AW_CACHE_VERSION, sizeof (AwPcm), 0 };
+    uint32_t norder = 0;
+    uint32_t first;
+    uint32_t i;
+    uint32_t j;
+    int probed;
+    int ok;
+
+    /* cards not fully probed are left out and probed next time, entries of unplugged cards have card -1 */
+    for (i = 0; i < aw_pcms_length && header[3] < AW_MAX_CARDS; i++)
+    {
+        for (j = 0; j < i && aw_pcms[j].card != aw_pcms[i].card; j++);
+
+        if (aw_pcms[i].card < 0 || j < i)
+            continue;
+
+        first = norder;
+        probed = 1;
+
+        for (j = i; j < aw_pcms_length; j++)
+        {
+            if (aw_pcms[j].card == aw_pcms[i].card)
+            {
+                order[norder++] = j;
+                probed = probed && aw_pcms[j].probed;
+            }
+        }
+        if (probed && aw_get_card (aw_pcms[i].card, &cards[header[3]]) == 0)
+        {
+            card_npcms[header[3]] = norder - first;
+            header[3]++;
+
+        } else {
+
+            norder = first;
+        }
+    }
+
+    /* written aside and renamed, a crash never leaves a half cache */
+    snprintf (tmp_path, sizeof tmp_path, "%s.tmp", cache_path);
+
+    if ((p_f = fopen (tmp_path, "wb")) == NULL)
+        return aw_handle_err (strerror (errno));
+
+    ok = fwrite (header, sizeof header, 1, p_f) == 1;
+
+    for (i = 0, first = 0; ok && i < header[3]; i++)
+    {
+        ok = fwrite (&cards[i], sizeof (AwCard), 1, p_f) == 1 && fwrite (&card_npcms[i], sizeof (uint32_t), 1, p_f) == 1;
+
+        for (j = 0; ok && j < card_npcms[i]; j++)
+            ok = fwrite (&aw_pcms[order[first + j]], sizeof (AwPcm), 1, p_f) == 1;
+        first += card_npcms[i];
+    }
+
+    if (fclose (p_f) == EOF || !ok || rename (tmp_path, cache_path) < 0)
+    {
+        unlink (tmp_path);
+        return aw_handle_err ("cannot write device cache");
+    }
+    return 0;
+}
+
+int aw_get_pcm_devices_cached (AwPcm aw_pcms[], uint8_t* p_aw_pcms_length, const char* cache_path, int lazy)
+{
+    AwCard cached_cards[AW_MAX_CARDS];
+    uint32_t cached_npcms[AW_MAX_CARDS];
+    AwPcm cached_pcms[AW_MAX_PCMS_LENGTH];
+    uint32_t ncached = 0;
+    AwCard card;
+    uint32_t ncards = 0;
+    uint32_t first;
+    uint32_t i;
+    uint8_t start;
+    int card_i = -1;
+    int changed = 0;
+    int unprobed = 0;
+
+    if (cache_path != NULL)
+        ncached = aw_cache_load (cache_path, cached_cards, cached_npcms, cached_pcms);
+
+    *p_aw_pcms_length = 0;
+
+    while (snd_card_next (&card_i) == 0 && card_i >= 0)
+    {
+        if (aw_get_card (card_i, &card) < 0)
+            continue;
+
+        start = *p_aw_pcms_length;
+
+        for (i = 0, first = 0; i < ncached && memcmp (&cached_cards[i], &card, sizeof (AwCard)) != 0; i++)
+            first += cached_npcms[i];
+
+        if (i < ncached && start + cached_npcms[i] <= AW_MAX_PCMS_LENGTH)
+        {
+            memcpy (&aw_pcms[start], &cached_pcms[first], cached_npcms[i] * sizeof (AwPcm));
+            *p_aw_pcms_length += cached_npcms[i];
+
+        } else if (lazy) {
+
+            aw_list_card (card_i, aw_pcms, p_aw_pcms_length);
+            unprobed += *p_aw_pcms_length - start;
+            changed = 1;
+
+        } else {
+
+            aw_probe_card (card_i, aw_pcms, p_aw_pcms_length);
+            changed = 1;
+        }
+        ncards++;
+    }
+
+    /* a card unplugged since the cache was written */
+    if (ncards != ncached)
+        changed = 1;
+
+    /* with devices left to probe the caller saves once they are done */
+    if (cache_path != NULL && changed && unprobed == 0)
+        aw_save_pcm_devices_cache (aw_pcms, *p_aw_pcms_length, cache_path);
+
+    return unprobed;
+}
+
+/* card hotplug: the control device node of a card comes and goes with it */
+int aw_hotplug_open ()
+{
+    int fd;
+
+    if ((fd = inotify_init1 (IN_CLOEXEC)) < 0)
+        return aw_handle_err (strerror (errno));
+
+    if (inotify_add_watch (fd, AW_HOTPLUG_DIR, IN_CREATE | IN_DELETE) < 0)
+    {
+        close (fd);
+        return aw_handle_err (strerror (errno));
+    }
+    return fd;
+}
+
+/* blocks until something changes in AW_HOTPLUG_DIR, returns the card events read, -1 once fd is closed */
+int aw_hotplug_wait (int fd, AwHotplugEvent events[], int max_events)
+{
+    char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    struct inotify_event* p_event;
+    ssize_t nbytes;
+    char* p;
+    int card;
+    int n = 0;
+
+    if ((nbytes = read (fd, buffer, sizeof buffer)) <= 0)
+        return nbytes < 0 && errno == EINTR ? 0 : -1;
+
+    for (p = buffer; p < buffer + nbytes && n < max_events; p += sizeof (struct inotify_event) + (*p_event).len)
+    {
+        p_event = (struct inotify_event*) p;
+
+        if ((*p_event).len > 0 && sscanf ((*p_event).name, "controlC%d", &card) == 1)
+        {
+            events[n].card = card;
+            events[n].added = ((*p_event).mask & IN_CREATE) != 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+int aw_print_pcms (AwPcm aw_pcms[], uint8_t aw_pcms_length)
+{
+    int i;
+    int j;
+
+    printf("There are %d pcms\n", aw_pcms_length);
+
+    for (i = 0; i < aw_pcms_length; i++)
+    {
+        printf("\nPCM: %s\n", (*(aw_pcms + i)).name);
+        printf("\n    card name: %s", (*(aw_pcms + i)).cardname);
+        printf("\n    card long name: %s", (*(aw_pcms + i)).cardlongname);
+        printf("\n    has plughw: %s\n", (*(aw_pcms + i)).has_plughw ? "true" : "false");
+
+        if ((*(aw_pcms + i)).mode == SND_PCM_STREAM_PLAYBACK) 
+            printf("    mode:  playback");
+        else
+            printf("    mode:  capture");
+        
+        printf("\n    nchannels:  ");
+        j = 0;
+        while ((*(aw_pcms + i)).nchannels[j] != -1)
+        {
+            printf("%d  ", (*(aw_pcms + i)).nchannels[j]);
+            j++;
+        }       
+
+        printf("\n    framerates:  ");
+        j = 0;
+        while ((*(aw_pcms + i)).framerates[j] != -1)
+        {
+            printf("%d  ", (*(aw_pcms + i)).framerates[j]);
+            j++;
+        }       
+
+        printf("\n    period/buffer frames:  ");
+        j = 0;
+        while ((*(aw_pcms + i)).framerates[j] != -1)
+        {
+            printf("%d: %lu-%lu/%lu-%lu  ", (*(aw_pcms + i)).framerates[j], (*(aw_pcms + i)).period_size_min[j], (*(aw_pcms + i)).period_size_max[j], (*(aw_pcms + i)).buffer_size_min[j], (*(aw_pcms + i)).buffer_size_max[j]);
+            j++;
+        }       
+
+        printf("\n    formats:  ");
+        j = 0;
+        while ((*(aw_pcms + i)).formats[j] != SND_PCM_FORMAT_UNKNOWN)
+        {
+            printf("%s (%s)  ", snd_pcm_format_name((*(aw_pcms + i)).formats[j]), snd_pcm_format_description((*(aw_pcms + i)).formats[j]));
+            j++;
+        }       
+        printf("\n"); 
+    }
+    return 0;
+}
+
+int aw_print_pcm (AwPcm* p_aw_pcm) 
+{
+    int j;
+    
+    printf("\nPCM: %s\n", (*p_aw_pcm).name);
+    printf("\n    card name: %s", (*p_aw_pcm).cardname);
+    printf("\n    card long name: %s", (*p_aw_pcm).cardlongname);
+    printf("\n    has plughw: %s\n", (*p_aw_pcm).has_plughw ? "true" : "false");
+    
+    if ((*p_aw_pcm).mode == SND_PCM_STREAM_PLAYBACK) 
+        printf("    mode:  playback");
+    else
+        printf("    mode:  capture");
+        
+    printf("\n    nchannels:  ");
+    j = 0;
+    while ((*p_aw_pcm).nchannels[j] != -1 && j < 100)
+    {
+        printf("%d  ", (*p_aw_pcm).nchannels[j]);
+        j++;
+    }     
+    printf("\n    framerates:  ");
+    j = 0;
+    while ((*p_aw_pcm).framerates[j] != -1)
+    {
+        printf("%d  ", (*p_aw_pcm).framerates[j]);
+        j++;
+    }       
+    printf("\n    period/buffer frames:  ");
+    j = 0;
+    while ((*p_aw_pcm).framerates[j] != -1)
+    {
+        printf("%d: %lu-%lu/%lu-%lu  ", (*p_aw_pcm).framerates[j], (*p_aw_pcm).period_size_min[j], (*p_aw_pcm).period_size_max[j], (*p_aw_pcm).buffer_size_min[j], (*p_aw_pcm).buffer_size_max[j]);
+        j++;
+    }       
+    printf("\n    formats:  ");
+    j = 0;
+    while ((*p_aw_pcm).formats[j] != SND_PCM_FORMAT_UNKNOWN)
+    {
+        printf("%s (%s)  ", snd_pcm_format_name((*p_aw_pcm).formats[j]), snd_pcm_format_description((*p_aw_pcm).formats[j]));
+        j++;
+    }       
+    printf("\n"); 
+
+    return 0;
+}
+
+
+/*============================================================================
+                pcm parameters
+============================================================================*/
+
+
+int aw_set_params (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params)
+{
+    int err;
+    int dir = 0;
+    snd_pcm_hw_params_t* p_alsa_hw_params;
+    unsigned int period_time = (*p_hw_params).period_time > 0 ? (*p_hw_params).period_time : AW_DEFAULT_PERIOD_TIME;
+    unsigned int period_count = (*p_hw_params).period_count > 0 ? (*p_hw_params).period_count : AW_DEFAULT_PERIOD_COUNT;
+    snd_pcm_uframes_t buffer_size;
+    
+    if ((err = snd_pcm_hw_params_malloc (&p_alsa_hw_params)) < 0)
+        return aw_handle_err (snd_strerror (err));
+    
+    if ((err = snd_pcm_hw_params_any (p_pcm, p_alsa_hw_params)) < 0)
+        return aw_handle_err (snd_strerror (err));
+    
+    /* mmap lets the capture thread meter straight from the dma area, fall back to rw when refused */
+
+    if ((*p_hw_params).access != SND_PCM_ACCESS_MMAP_INTERLEAVED ||
+        snd_pcm_hw_params_test_access (p_pcm, p_alsa_hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+        (*p_hw_params).access = SND_PCM_ACCESS_RW_INTERLEAVED;
+
+    if ((err = snd_pcm_hw_params_set_access (p_pcm, p_alsa_hw_params, (*p_hw_params).access)) < 0)
+        return aw_handle_err (snd_strerror (err));
+    
+    if ((err = snd_pcm_hw_params_set_format (p_pcm, p_alsa_hw_params, (*p_hw_params).format)) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    if ((err = snd_pcm_hw_params_set_rate (p_pcm, p_alsa_hw_params, (*p_hw_params).framerate, 0)) < 0)
+        return aw_handle_err (snd_strerror (err));
+        
+    if ((err = snd_pcm_hw_params_set_channels (p_pcm, p_alsa_hw_params, (*p_hw_params).nchannels)) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    /* set buffer and period, the device may round both */
+    
+    if ((err = snd_pcm_hw_params_set_period_time_near (p_pcm, p_alsa_hw_params, &period_time, &dir)) < 0)
+        return aw_handle_err (snd_strerror (err));    
+
+    if ((err = snd_pcm_hw_params_get_period_size (p_alsa_hw_params, &(*p_hw_params).period_size, &dir)) < 0)
+        return aw_handle_err (snd_strerror (err));    
+
+    buffer_size = (*p_hw_params).period_size * period_count;
+
+    if ((err = snd_pcm_hw_params_set_buffer_size_near (p_pcm, p_alsa_hw_params, &buffer_size)) < 0)
+        return aw_handle_err (snd_strerror (err));    
+
+    if ((err = snd_pcm_hw_params (p_pcm, p_alsa_hw_params)) < 0)
+        return aw_handle_err (snd_strerror(err));
+
+    snd_pcm_hw_params_get_period_size (p_alsa_hw_params, &(*p_hw_params).period_size, &dir);
+    snd_pcm_hw_params_get_buffer_size (p_alsa_hw_params, &(*p_hw_params).buffer_size);
+    snd_pcm_hw_params_get_period_time (p_alsa_hw_params, &(*p_hw_params).period_time, &dir);
+    (*p_hw_params).period_count = (*p_hw_params).buffer_size / (*p_hw_params).period_size;
+
+    /* complete params */
+
+    if ((*p_hw_params).format == SND_PCM_FORMAT_S8)
+    {
+        (*p_hw_params).p_parser = &aw_parser_S8;
+
+    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S16_LE) {
+
+        (*p_hw_params).p_parser = &aw_parser_S16_LE;
+    
+    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S24_3LE) {
+
+        (*p_hw_params).p_parser = &aw_parser_S24_3LE;
+    
+    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S24_LE) {
+
+        (*p_hw_params).p_parser = &aw_parser_S32_LE;
+    
+    } else if ((*p_hw_params).format == SND_PCM_FORMAT_S32_LE) {
+        
+        (*p_hw_params).p_parser = &aw_parser_S32_LE;
+    
+    } else {
+
+        (*p_hw_params).p_parser = NULL;
+        return aw_handle_err ("format not recognized");
+    }
+
+    (*p_hw_params).nominal_bits = snd_pcm_format_width ((*p_hw_params).format);
+    (*p_hw_params).real_bits = snd_pcm_format_physical_width ((*p_hw_params).format);
+    (*p_hw_params).max = pow (2, (*p_hw_params).nominal_bits) / 2;
+
+    if (aw_select_kernel (p_hw_params) < 0)
+        return aw_handle_err ("format not recognized");
+
+    (*p_hw_params).samplesize = (*p_hw_params).real_bits / 8;
+    (*p_hw_params).samplerate = (*p_hw_params).nchannels * (*p_hw_params).framerate;    
+    (*p_hw_params).framesize = (*p_hw_params).nchannels * (*p_hw_params).samplesize;
+    (*p_hw_params).byterate = (*p_hw_params).samplerate * (*p_hw_params).samplesize;
+    snprintf((*p_hw_params).description, sizeof (*p_hw_params).description, "channels %d framerate %d format %s (%s)", (*p_hw_params).nchannels, (*p_hw_params).framerate, snd_pcm_format_name((*p_hw_params).format), snd_pcm_format_description((*p_hw_params).format));
+
+    snd_pcm_hw_params_free (p_alsa_hw_params);
+
+    return 0;
+}
+
+int aw_print_params (AwPcmParams hw_params)
+{   
+    printf ("\nHW PARAMS\n\n");
+
+    printf ("nchannels: %d\n", hw_params.nchannels);
+    printf ("framerate: %d\n", hw_params.framerate);
+    printf ("format: %s\n", snd_pcm_format_name (hw_params.format));
+    printf ("access: %s\n", hw_params.access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw");
+    printf ("is_signed: %s\n", hw_params.is_signed ? "true" : "false");
+    printf ("is_little_endian: %s\n", hw_params.is_little_endian ? "true" : "false");
+    printf ("nominal_bits: %d\n", hw_params.nominal_bits);
+    printf ("real_bits: %d\n", hw_params.real_bits);
+    printf ("samplesize: %d\n", hw_params.samplesize);
+    printf ("samplerate: %d\n", hw_params.samplerate);
+    printf ("framesize: %d\n", hw_params.framesize);
+    printf ("byterate: %d\n", hw_params.byterate);
+    printf ("max: %d\n", hw_params.max);
+    printf ("period_time: %u usec\n", hw_params.period_time);
+    printf ("period_size: %ld\n", hw_params.period_size);
+    printf ("buffer_size: %ld (%u periods)\n", hw_params.buffer_size, hw_params.period_count);
+    printf ("description: %s\n", hw_params.description);
+
+    return 0;
+}
+
+
+/*============================================================================
+                wav files
+============================================================================*/
+
+
+/*
+ * header layout: RIFF, a JUNK chunk sized as a ds64 chunk, fmt, data.
+ * past 4 GiB the same bytes are rewritten as RF64 with the JUNK turned into ds64 (EBU Tech 3306),
+ * so the switch never moves audio data.
+*/
+
+static unsigned char* aw_put_le16 (unsigned char* p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    return p + 2;
+}
+
+static unsigned char* aw_put_le32 (unsigned char* p, uint32_t value)
+{
+    p = aw_put_le16 (p, value);
+    return aw_put_le16 (p, value >> 16);
+}
+
+static unsigned char* aw_put_le64 (unsigned char* p, uint64_t value)
+{
+    p = aw_put_le32 (p, value);
+    return aw_put_le32 (p, value >> 32);
+}
+
+static unsigned char* aw_put_id (unsigned char* p, const char* id)
+{
+    memcpy (p, id, 4);
+    return p + 4;
+}
+
+static const unsigned char AW_KSDATAFORMAT_SUBTYPE_PCM[16] = {
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+/*
+ * speaker positions for the channel counts where ALSA's default order matches the wav order,
+ * anything else is left unassigned rather than mislabelled
+*/
+static uint32_t aw_wav_channel_mask (uint8_t nchannels)
+{
+    switch (nchannels)
+    {
+        case 1: return AW_SPEAKER_FRONT_CENTER;
+        case 2: return AW_SPEAKER_FRONT_LEFT | AW_SPEAKER_FRONT_RIGHT;
+        case 4: return AW_SPEAKER_FRONT_LEFT | AW_SPEAKER_FRONT_RIGHT | AW_SPEAKER_BACK_LEFT | AW_SPEAKER_BACK_RIGHT;
+        default: return 0;
+    }
+}
+
+int aw_wav_build_header (unsigned char* p_header, AwPcmParams* p_params, uint64_t data_size, int rf64)
+{
+    unsigned char* p = p_header;
+    uint64_t riff_size;
+    int extensible;
+    
+    p += 12;
+
+    /* ds64 or its JUNK placeholder */
+    p = aw_put_id (p, rf64 ? "ds64" : "JUNK");
+    p = aw_put_le32 (p, AW_WAV_DS64_SIZE);
+    p = aw_put_le64 (p, 0);
+    p = aw_put_le64 (p, rf64 ? data_size : 0);
+    p = aw_put_le64 (p, rf64 ? data_size / (*p_params).framesize : 0);
+    p = aw_put_le32 (p, 0);
+
+    /* fmt, extensible when plain PCM can't describe the stream */
+    extensible = (*p_params).nchannels > 2 || (*p_params).nominal_bits != (*p_params).real_bits;
+
+    p = aw_put_id (p, "fmt ");
+    p = aw_put_le32 (p, extensible ? 40 : 16);
+    p = aw_put_le16 (p, extensible ? AW_WAVE_FORMAT_EXTENSIBLE : AW_WAVE_FORMAT_PCM);
+    p = aw_put_le16 (p, (*p_params).nchannels);
+    p = aw_put_le32 (p, (*p_params).framerate);
+    p = aw_put_le32 (p, (*p_params).byterate);
+    p = aw_put_le16 (p, (*p_params).framesize);
+    p = aw_put_le16 (p, (*p_params).real_bits);
+
+    if (extensible)
+    {
+        p = aw_put_le16 (p, 22);
+        p = aw_put_le16 (p, (*p_params).nominal_bits);
+        p = aw_put_le32 (p, aw_wav_channel_mask ((*p_params).nchannels));
+        memcpy (p, AW_KSDATAFORMAT_SUBTYPE_PCM, 16);
+        p += 16;
+    }
+
+    /* data */
+    p = aw_put_id (p, "data");
+    p = aw_put_le32 (p, rf64 ? UINT32_MAX : data_size);
+
+    /* riff, sizes are known now */
+    riff_size = (p - p_header) - 8 + data_size + (data_size & 1);
+
+    aw_put_id (p_header, rf64 ? "RF64" : "RIFF");
+    aw_put_le32 (p_header + 4, rf64 ? UINT32_MAX : riff_size);
+    aw_put_id (p_header + 8, "WAVE");
+
+    if (rf64)
+        aw_put_le64 (p_header + 20, riff_size);
+
+    return p - p_header;
+}
+
+/* true once the sizes no longer fit the 32 bit RIFF fields */
+int aw_wav_needs_rf64 (AwPcmParams* p_params, uint64_t data_size)
+{
+    unsigned char header[AW_WAV_HEADER_MAX];
+
+    return aw_wav_build_header (header, p_params, 0, 0) - 8 + data_size + 1 > UINT32_MAX;
+}
+
+/* header with zero sizes, data is streamed right after it */
+int aw_wav_write_header (FILE* p_f, AwPcmParams* p_params)
+{
+    unsigned char header[AW_WAV_HEADER_MAX];
+    int length;
+
+    length = aw_wav_build_header (header, p_params, 0, 0);
+
+    if (fwrite (header, 1, length, p_f) != length)
+        return aw_handle_err (strerror (errno));
+
+    return 0;
+}
+
+/* seek back and rewrite the header in place, the file position is kept at the end */
+int aw_wav_patch_header (FILE* p_f, AwPcmParams* p_params, uint64_t data_size, int rf64)
+{
+    unsigned char header[AW_WAV_HEADER_MAX];
+    int length;
+
+    length = aw_wav_build_header (header, p_params, data_size, rf64);
+
+    if (fseeko (p_f, 0, SEEK_SET) < 0)
+        return aw_handle_err (strerror (errno));
+
+    if (fwrite (header, 1, length, p_f) != length)
+        return aw_handle_err (strerror (errno));
+
+    if (fseeko (p_f, 0, SEEK_END) < 0 || fflush (p_f) == EOF)
+        return aw_handle_err (strerror (errno));
+
+    return 0;
+}
+
+/* pad the data chunk to even size and fill in the final sizes */
+int aw_wav_finalize (FILE* p_f, AwPcmParams* p_params, uint64_t data_size)
+{
+    if (data_size & 1)
+        fputc (0, p_f);
+
+    return aw_wav_patch_header (p_f, p_params, data_size, aw_wav_needs_rf64 (p_params, data_size));
+}
+
+
+/*============================================================================
+                mp3 encoding
+============================================================================*/
+
+
+/*
+ * frames go to lame in chunks of AW_UNPACK_CHUNK, unpacked to int32 and deinterleaved,
+ * mp3 has at most two channels so wider streams keep the first two (front left and right).
+*/
+
+static int aw_mp3_begin (AwWriter* p_writer)
+{
+    AwPcmParams* p_params = (*p_writer).p_params;
+    int nchannels = (*p_params).nchannels > 2 ? 2 : (*p_params).nchannels;
+
+    if ((*p_params).p_unpack == NULL)
+        return aw_handle_err ("no unpacker for mp3 encoding");
+
+    if (((*p_writer).p_lame = lame_init ()) == NULL)
+        return aw_handle_err ("cannot init lame");
+
+    lame_set_in_samplerate ((*p_writer).p_lame, (*p_params).framerate);
+    lame_set_num_channels ((*p_writer).p_lame, nchannels);
+    lame_set_mode ((*p_writer).p_lame, nchannels == 1 ? MONO : JOINT_STEREO);
+    lame_set_VBR ((*p_writer).p_lame, vbr_default);
+    lame_set_VBR_quality ((*p_writer).p_lame, AW_MP3_VBR_QUALITY);
+    lame_set_write_id3tag_automatic ((*p_writer).p_lame, 0);
+
+    if (lame_init_params ((*p_writer).p_lame) < 0)
+    {
+        lame_close ((*p_writer).p_lame);
+        return aw_handle_err ("lame does not accept the pcm params");
+    }
+
+    /* interleaved chunk, then left and right planes */
+    (*p_writer).mp3_buffer_size = 5 * AW_UNPACK_CHUNK / 4 + 7200;
+    (*p_writer).p_samples = malloc (sizeof (int32_t) * AW_UNPACK_CHUNK * ((*p_params).nchannels + 2));
+    (*p_writer).p_mp3_buffer = malloc ((*p_writer).mp3_buffer_size);
+
+    if ((*p_writer).p_samples == NULL || (*p_writer).p_mp3_buffer == NULL)
+    {
+        free ((*p_writer).p_samples);
+        free ((*p_writer).p_mp3_buffer);
+        lame_close ((*p_writer).p_lame);
+        return aw_handle_err ("cannot allocate mp3 buffers");
+    }
+    (*p_writer).data_size = 0;
+
+    return 0;
+}
+
+static int aw_mp3_write (AwWriter* p_writer, char* p_buffer, snd_pcm_uframes_t nframes)
+{
+    AwPcmParams* p_params = (*p_writer).p_params;
+    uint8_t nchannels = (*p_params).nchannels;
+    int32_t* p_left = (*p_writer).p_samples + AW_UNPACK_CHUNK * nchannels;
+    int32_t* p_right = p_left + AW_UNPACK_CHUNK;
+    int shift = 32 - (*p_params).nominal_bits;
+    snd_pcm_uframes_t chunk;
+    snd_pcm_uframes_t i;
+    int nbytes;
+
+    while (nframes > 0)
+    {
+        chunk = nframes < AW_UNPACK_CHUNK ? nframes : AW_UNPACK_CHUNK;
+
+        (*(*p_params).p_unpack) (p_buffer, (*p_writer).p_samples, chunk * nchannels);
+
+        /* lame wants full scale 32 bit samples */
+        for (i = 0; i < chunk; i++)
+        {
+            p_left[i] = (uint32_t) (*p_writer).p_samples[i * nchannels] << shift;
+            p_right[i] = (uint32_t) (*p_writer).p_samples[i * nchannels + (nchannels > 1)] << shift;
+        }
+        nbytes = lame_encode_buffer_int ((*p_writer).p_lame, p_left, p_right, chunk, (*p_writer).p_mp3_buffer, (*p_writer).mp3_buffer_size);
+
+        if (nbytes < 0)
+            return aw_handle_err ("lame encoding error");
+
+        if (fwrite ((*p_writer).p_mp3_buffer, 1, nbytes, *(*p_writer).p_p_f) != nbytes)
+            return aw_handle_err (strerror (errno));
+
+        (*p_writer).data_size += nbytes;
+        p_buffer += chunk * (*p_params).framesize;
+        nframes -= chunk;
+    }
+    return 0;
+}
+
+/* flush the encoder and put the vbr info frame in place of the placeholder lame wrote first */
+static int aw_mp3_end (AwWriter* p_writer)
+{
+    FILE* p_f = *(*p_writer).p_p_f;
+    size_t nbytes;
+    int flushed;
+    int err = 0;
+
+    if ((flushed = lame_encode_flush ((*p_writer).p_lame, (*p_writer).p_mp3_buffer, (*p_writer).mp3_buffer_size)) < 0)
+        err = aw_handle_err ("lame flushing error");
+
+    else if (fwrite ((*p_writer).p_mp3_buffer, 1, flushed, p_f) != flushed)
+        err = aw_handle_err (strerror (errno));
+
+    nbytes = lame_get_lametag_frame ((*p_writer).p_lame, (*p_writer).p_mp3_buffer, (*p_writer).mp3_buffer_size);
+
+    if (err == 0 && nbytes > 0 && nbytes <= (*p_writer).mp3_buffer_size)
+    {
+        if (fseeko (p_f, 0, SEEK_SET) < 0
+            || fwrite ((*p_writer).p_mp3_buffer, 1, nbytes, p_f) != nbytes
+            || fseeko (p_f, 0, SEEK_END) < 0)
+            err = aw_handle_err (strerror (errno));
+    }
+    if (fflush (p_f) == EOF)
+        err = aw_handle_err (strerror (errno));
+
+    lame_close ((*p_writer).p_lame);
+    free ((*p_writer).p_samples);
+    free ((*p_writer).p_mp3_buffer);
+    (*p_writer).p_lame = NULL;
+
+    return err;
+}
+
+
+/*============================================================================
+                flac encoding
+============================================================================*/
+
+
+/*
+ * libFLAC writes through these callbacks on the writer's own FILE, seeking back to fill in STREAMINFO at the end.
+ * frames are independent, so with threads libFLAC encodes several of them at once.
+*/
+
+static FLAC__StreamEncoderWriteStatus aw_flac_write_cb (const FLAC__StreamEncoder* p_encoder, const FLAC__byte buffer[],
+                                                        size_t bytes, uint32_t samples, uint32_t current_frame, void* p_writer_)
+{
+    AwWriter* p_writer = (AwWriter*) p_writer_;
+
+    if (fwrite (buffer, 1, bytes, *(*p_writer).p_p_f) != bytes)
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+
+    (*p_writer).data_size += bytes;
+
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static FLAC__StreamEncoderSeekStatus aw_flac_seek_cb (const FLAC__StreamEncoder* p_encoder, FLAC__uint64 offset, void* p_writer_)
+{
+    AwWriter* p_writer = (AwWriter*) p_writer_;
+
+    if (fseeko (*(*p_writer).p_p_f, offset, SEEK_SET) < 0)
+        return FLAC__STREAM_ENCODER_SEEK_STATUS_ERROR;
+
+    return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamEncoderTellStatus aw_flac_tell_cb (const FLAC__StreamEncoder* p_encoder, FLAC__uint64* p_offset, void* p_writer_)
+{
+    AwWriter* p_writer = (AwWriter*) p_writer_;
+    off_t offset;
+
+    if ((offset = ftello (*(*p_writer).p_p_f)) < 0)
+        return FLAC__STREAM_ENCODER_TELL_STATUS_ERROR;
+
+    *p_offset = offset;
+
+    return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+static int aw_flac_begin (AwWriter* p_writer)
+{
+    AwPcmParams* p_params = (*p_writer).p_params;
+    size_t slot_frames = (*p_writer).ring.slot_bytes / (*p_params).framesize;
+
+    if ((*p_params).p_unpack == NULL)
+        return aw_handle_err ("no unpacker for flac encoding");
+
+    if ((*p_params).nchannels > AW_FLAC_MAX_CHANNELS)
+        return aw_handle_err ("too many channels for flac");
+
+    if (((*p_writer).p_flac = FLAC__stream_encoder_new ()) == NULL)
+        return aw_handle_err ("cannot allocate flac encoder");
+
+    FLAC__stream_encoder_set_channels ((*p_writer).p_flac, (*p_params).nchannels);
+    FLAC__stream_encoder_set_bits_per_sample ((*p_writer).p_flac, (*p_params).nominal_bits);
+    FLAC__stream_encoder_set_sample_rate ((*p_writer).p_flac, (*p_params).framerate);
+    FLAC__stream_encoder_set_compression_level ((*p_writer).p_flac, AW_FLAC_COMPRESSION_LEVEL);
+
+    /* a libFLAC built without threads keeps encoding on the writer thread */
+    if ((*p_writer).flac_threads > 1
+        && FLAC__stream_encoder_set_num_threads ((*p_writer).p_flac, (*p_writer).flac_threads) != FLAC__STREAM_ENCODER_SET_NUM_THREADS_OK)
+        printf ("flac: threads not available, encoding on a single thread\n");
+
+    (*p_writer).data_size = 0;
+
+    if (((*p_writer).p_samples = malloc (sizeof (int32_t) * slot_frames * (*p_params).nchannels)) == NULL)
+    {
+        FLAC__stream_encoder_delete ((*p_writer).p_flac);
+        return aw_handle_err ("cannot allocate flac buffer");
+    }
+    if (FLAC__stream_encoder_init_stream ((*p_writer).p_flac, aw_flac_write_cb, aw_flac_seek_cb, aw_flac_tell_cb, NULL, p_writer)
+        != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+        free ((*p_writer).p_samples);
+        FLAC__stream_encoder_delete ((*p_writer).p_flac);
+        return aw_handle_err ("flac encoder does not accept the pcm params");
+    }
+    return 0;
+}
+
+static int aw_flac_write (AwWriter* p_writer, char* p_buffer, snd_pcm_uframes_t nframes)
+{
+    AwPcmParams* p_params = (*p_writer).p_params;
+
+    /* libFLAC takes right aligned samples at bits_per_sample, as the unpackers give them */
+    (*(*p_params).p_unpack) (p_buffer, (*p_writer).p_samples, nframes * (*p_params).nchannels);
+
+    if (!FLAC__stream_encoder_process_interleaved ((*p_writer).p_flac, (*p_writer).p_samples, nframes))
+        return aw_handle_err ("flac encoding error");
+
+    return 0;
+}
+
+static int aw_flac_end (AwWriter* p_writer)
+{
+    int err = 0;
+
+    if (!FLAC__stream_encoder_finish ((*p_writer).p_flac))
+        err = aw_handle_err ("flac encoder did not finish cleanly");
+
+    if (fseeko (*(*p_writer).p_p_f, 0, SEEK_END) < 0 || fflush (*(*p_writer).p_p_f) == EOF)
+        err = aw_handle_err (strerror (errno));
+
+    FLAC__stream_encoder_delete ((*p_writer).p_flac);
+    free ((*p_writer).p_samples);
+    (*p_writer).p_flac = NULL;
+
+    return err;
+}
+
+
+/*============================================================================
+                memory arena
+============================================================================*/
+
+
+/*
+ * the arena is written through a stdio cookie, so every encoder (and its header seeks) works on it unchanged.
+ * once the budget is exceeded the blocks go to the spill file one per write and are unmapped,
+ * so the writer thread is never held by more than a block; when the last one is out
+ * the cookie writes straight to that file.
+*/
+
+/* p_progress (per mille) and p_cancel may be NULL, both are looked at between batches of blocks */
+static int aw_arena_writev (AwArena* p_arena, int fd, atomic_int* p_progress, atomic_int* p_cancel)
+{
+    struct iovec iov[AW_ARENA_WRITEV_BATCH];
+    struct iovec* p_iov;
+    size_t chunk = 0;
+    int n;
+    ssize_t written;
+    off_t left = (*p_arena).size;
+
+    while (left > 0)
+    {
+        if (p_cancel != NULL && atomic_load (p_cancel))
+        {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        /* next batch of blocks, only the last one of the arena is partially filled */
+        for (n = 0; n < AW_ARENA_WRITEV_BATCH && left > 0; n++, chunk++)
+        {
+            iov[n].iov_base = (*p_arena).p_p_chunks[chunk];
+            iov[n].iov_len = left < AW_ARENA_CHUNK ? left : AW_ARENA_CHUNK;
+            left -= iov[n].iov_len;
+        }
+
+        /* short writes resume where they stopped */
+        for (p_iov = iov; n > 0; )
+        {
+            if ((written = writev (fd, p_iov, n)) < 0)
+            {
+                if (errno == EINTR) continue;
+                return aw_handle_err (strerror (errno));
+            }
+            while (n > 0 && written >= (*p_iov).iov_len)
+            {
+                written -= (*p_iov).iov_len;
+                p_iov++;
+                n--;
+            }
+            if (n > 0)
+            {
+                (*p_iov).iov_base = (char*) (*p_iov).iov_base + written;
+                (*p_iov).iov_len -= written;
+            }
+        }
+        if (p_progress != NULL)
+            atomic_store (p_progress, ((*p_arena).size - left) * 1000 / (*p_arena).size);
+    }
+    return 0;
+}
+
+static int aw_arena_unmap (AwArena* p_arena)
+{
+    size_t i;
+
+    for (i = (*p_arena).nspilled; i < (*p_arena).nchunks; i++)
+        munmap ((*p_arena).p_p_chunks[i], AW_ARENA_CHUNK);
+
+    free ((*p_arena).p_p_chunks);
+    (*p_arena).p_p_chunks = NULL;
+    (*p_arena).nchunks = 0;
+    (*p_arena).max_chunks = 0;
+
+    return 0;
+}
+
+static int aw_arena_grow (AwArena* p_arena)
+{
+    char** p_p_chunks;
+    char* p_chunk;
+
+    if ((*p_arena).nchunks == (*p_arena).max_chunks)
+    {
+        if ((p_p_chunks = realloc ((*p_arena).p_p_chunks, sizeof (char*) * ((*p_arena).max_chunks * 2 + 16))) == NULL)
+            return aw_handle_err (strerror (errno));
+
+        (*p_arena).p_p_chunks = p_p_chunks;
+        (*p_arena).max_chunks = (*p_arena).max_chunks * 2 + 16;
+    }
+
+    /* populated now, so appending never page faults */
+    if ((p_chunk = mmap (NULL, AW_ARENA_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0)) == MAP_FAILED)
+        return aw_handle_err (strerror (errno));
+
+    if ((*p_arena).lock && mlock (p_chunk, AW_ARENA_CHUNK) < 0)
+    {
+        aw_handle_err ("cannot lock arena memory, going on unlocked");
+        (*p_arena).lock = 0;
+    }
+    (*p_arena).p_p_chunks[(*p_arena).nchunks++] = p_chunk;
+
+    return 0;
+}
+
+/* moves the next block to the spill file, opening it on the first one */
+static int aw_arena_spill (AwArena* p_arena)
+{
+    char* p_chunk = (*p_arena).p_p_chunks[(*p_arena).nspilled];
+    off_t offset = (off_t) (*p_arena).nspilled * AW_ARENA_CHUNK;
+    size_t len = (*p_arena).size - offset < AW_ARENA_CHUNK ? (*p_arena).size - offset : AW_ARENA_CHUNK;
+    size_t done = 0;
+    ssize_t written;
+
+    if ((*p_arena).fd < 0)
+    {
+        if (((*p_arena).fd = open ((*p_arena).spill_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            return aw_handle_err (strerror (errno));
+
+        printf ("take exceeds the memory budget, spilling to %s\n", (*p_arena).spill_path);
+    }
+
+    while (done < len)
+    {
+        if ((written = pwrite ((*p_arena).fd, p_chunk + done, len - done, offset + done)) < 0)
+        {
+            if (errno == EINTR) continue;
+            return aw_handle_err (strerror (errno));
+        }
+        done += written;
+    }
+    munmap (p_chunk, AW_ARENA_CHUNK);
+    (*p_arena).p_p_chunks[(*p_arena).nspilled++] = NULL;
+
+    // only the last block is partially filled, after it nothing is left in memory
+    if ((*p_arena).nspilled == (*p_arena).nchunks)
+    {
+        aw_arena_unmap (p_arena);
+        (*p_arena).spilled = 1;
+    }
+    return 0;
+}
+
+static ssize_t aw_arena_write_cb (void* p_arena_, const char* p_buffer, size_t size)
+{
+    AwArena* p_arena = (AwArena*) p_arena_;
+    size_t done = 0;
+    size_t chunk;
+    size_t offset;
+    size_t n;
+    ssize_t written;
+
+    while (done < size)
+    {
+        chunk = ((*p_arena).pos + done) / AW_ARENA_CHUNK;
+        offset = ((*p_arena).pos + done) % AW_ARENA_CHUNK;
+
+        // spilled blocks, the header seeks land here too
+        if ((*p_arena).spilled || chunk < (*p_arena).nspilled)
+        {
+            n = (*p_arena).spilled || size - done < AW_ARENA_CHUNK - offset ? size - done : AW_ARENA_CHUNK - offset;
+
+            if ((written = pwrite ((*p_arena).fd, p_buffer + done, n, (*p_arena).pos + done)) < 0)
+            {
+                if (errno == EINTR) continue;
+                break;
+            }
+            done += written;
+
+        } else {
+
+            if (chunk >= (*p_arena).nchunks && aw_arena_grow (p_arena) < 0)
+                break;
+
+            n = size - done < AW_ARENA_CHUNK - offset ? size - done : AW_ARENA_CHUNK - offset;
+            memcpy ((*p_arena).p_p_chunks[chunk] + offset, p_buffer + done, n);
+            done += n;
+        }
+    }
+    (*p_arena).pos += done;
+
+    if ((*p_arena).pos > (*p_arena).size)
+        (*p_arena).size = (*p_arena).pos;
+
+    /* past the budget one block per write goes out, the take grows much slower than that */
+    if (!(*p_arena).spilled && (*p_arena).size > (*p_arena).budget && (*p_arena).nchunks > 0)
+        if (aw_arena_spill (p_arena) < 0)
+            return -1;
+
+    return done > 0 ? done : -1;
+}
+
+static int aw_arena_seek_cb (void* p_arena_, off64_t* p_offset, int whence)
+{
+    AwArena* p_arena = (AwArena*) p_arena_;
+    off_t pos;
+
+    if (whence == SEEK_SET) pos = *p_offset;
+    else if (whence == SEEK_CUR) pos = (*p_arena).pos + *p_offset;
+    else pos = (*p_arena).size + *p_offset;
+
+    /* no holes, the encoders only seek back into what they wrote */
+    if (pos < 0 || pos > (*p_arena).size)
+        return -1;
+
+    (*p_arena).pos = pos;
+    *p_offset = pos;
+
+    return 0;
+}
+
+static int aw_arena_close_cb (void* p_arena_)
+{
+    AwArena* p_arena = (AwArena*) p_arena_;
+
+    // a spill in progress is finished, the take is then all in the spill file
+    while ((*p_arena).fd >= 0 && !(*p_arena).spilled)
+        if (aw_arena_spill (p_arena) < 0)
+            return -1;
+
+    if ((*p_arena).fd >= 0 && close ((*p_arena).fd) < 0)
+        return -1;
+
+    (*p_arena).fd = -1;
+
+    return 0;
+}
+
+/* the arena outlives the FILE, it holds the take until aw_arena_save or aw_arena_free */
+FILE* aw_arena_open (AwArena* p_arena, size_t budget, int lock, const char* spill_path)
+{
+    cookie_io_functions_t functions = {
+
+        .read = NULL,
+        .write = aw_arena_write_cb,
+        .seek = aw_arena_seek_cb,
+        .close = aw_arena_close_cb
+    };
+
+    (*p_arena).p_p_chunks = NULL;
+    (*p_arena).nchunks = 0;
+    (*p_arena).max_chunks = 0;
+    (*p_arena).size = 0;
+    (*p_arena).pos = 0;
+    (*p_arena).budget = budget;
+    (*p_arena).lock = lock;
+    (*p_arena).spilled = 0;
+    (*p_arena).nspilled = 0;
+    (*p_arena).fd = -1;
+    snprintf ((*p_arena).spill_path, sizeof (*p_arena).spill_path, "%s", spill_path);
+
+    return fopencookie (p_arena, "w", functions);
+}
+
+/* once a spill starts the take is in the spill file, the blocks left in memory are not a whole take */
+int aw_arena_spilled (AwArena* p_arena)
+{
+    return (*p_arena).spilled || (*p_arena).nspilled > 0;
+}
+
+/* one sequential writev of the block list */
+int aw_arena_save (AwArena* p_arena, const char* path, atomic_int* p_progress, atomic_int* p_cancel)
+{
+    int fd;
+    int err;
+
+    if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return aw_handle_err (strerror (errno));
+
+    err = aw_arena_writev (p_arena, fd, p_progress, p_cancel);
+
+    if (close (fd) < 0 && err == 0)
+        err = -1;
+
+    // a canceled save is no error, either way the partial file goes and errno says why
+    if (err < 0)
+    {
+        err = errno;
+        remove (path);
+
+        if (err != ECANCELED)
+            aw_handle_err ("cannot save the take from memory");
+
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int aw_arena_free (AwArena* p_arena)
+{
+    aw_arena_unmap (p_arena);
+
+    if ((*p_arena).fd >= 0)
+        close ((*p_arena).fd);
+
+    (*p_arena).fd = -1;
+
+    return 0;
+}
+
+
+/*============================================================================
+                period ring and disk writer
+============================================================================*/
+
+
+int aw_ring_init (AwRing* p_ring, uint32_t depth, size_t slot_bytes)
+{
+    if (depth == 0)
+        return aw_handle_err ("ring depth must be positive");
+
+    (*p_ring).depth = depth;
+    (*p_ring).slot_bytes = slot_bytes;
+    atomic_init (&(*p_ring).head, 0);
+    atomic_init (&(*p_ring).tail, 0);
+    atomic_init (&(*p_ring).high_water, 0);
+    atomic_init (&(*p_ring).overflows, 0);
+
+    if (((*p_ring).p_data = (char*) calloc (depth, slot_bytes)) == NULL) 
+        return aw_handle_err (strerror (errno));
+    if (((*p_ring).nframes = (snd_pcm_uframes_t*) calloc (depth, sizeof (snd_pcm_uframes_t))) == NULL) 
+        return aw_handle_err (strerror (errno));
+    if (((*p_ring).kinds = (aw_slot_kind_t*) calloc (depth, sizeof (aw_slot_kind_t))) == NULL) 
+        return aw_handle_err (strerror (errno));
+
+    return 0;
+}
+
+int aw_ring_free (AwRing* p_ring)
+{
+    free ((*p_ring).p_data);
+    free ((*p_ring).nframes);
+    free ((*p_ring).kinds);
+
+    (*p_ring).p_data = NULL;
+    (*p_ring).nframes = NULL;
+    (*p_ring).kinds = NULL;
+
+    return 0;
+}
+
+/* producer side: next free slot or NULL when the writer is behind */
+char* aw_ring_reserve (AwRing* p_ring)
+{
+    uint32_t head = atomic_load_explicit (&(*p_ring).head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit (&(*p_ring).tail, memory_order_acquire);
+
+    if (head - tail >= (*p_ring).depth)
+        return NULL;
+    return (*p_ring).p_data + (size_t) (head % (*p_ring).depth) * (*p_ring).slot_bytes;
+}
+
+int aw_ring_commit (AwRing* p_ring, aw_slot_kind_t kind, snd_pcm_uframes_t nframes)
+{
+    uint32_t head = atomic_load_explicit (&(*p_ring).head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit (&(*p_ring).tail, memory_order_relaxed);
+
+    (*p_ring).kinds[head % (*p_ring).depth] = kind;
+    (*p_ring).nframes[head % (*p_ring).depth] = nframes;
+
+    atomic_store_explicit (&(*p_ring).head, head + 1, memory_order_release);
+
+    if (head + 1 - tail > atomic_load_explicit (&(*p_ring).high_water, memory_order_relaxed))
+        atomic_store_explicit (&(*p_ring).high_water, head + 1 - tail, memory_order_relaxed);
+
+    return 0;
+}
+
+/* consumer side: oldest committed slot or NULL when empty */
+char* aw_ring_peek (AwRing* p_ring, aw_slot_kind_t* p_kind, snd_pcm_uframes_t* p_nframes)
+{
+    uint32_t tail = atomic_load_explicit (&(*p_ring).tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit (&(*p_ring).head, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+
+    *p_kind = (*p_ring).kinds[tail % (*p_ring).depth];
+    *p_nframes = (*p_ring).nframes[tail % (*p_ring).depth];
+
+    return (*p_ring).p_data + (size_t) (tail % (*p_ring).depth) * (*p_ring).slot_bytes;
+}
+
+int aw_ring_release (AwRing* p_ring)
+{
+    uint32_t tail = atomic_load_explicit (&(*p_ring).tail, memory_order_relaxed);
+
+    atomic_store_explicit (&(*p_ring).tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+int aw_preroll_init (AwPreroll* p_preroll, uint32_t nchunks, size_t chunk_bytes)
+{
+    (*p_preroll).nchunks = nchunks;
+    (*p_preroll).chunk_bytes = chunk_bytes;
+    (*p_preroll).next = 0;
+    (*p_preroll).filled = 0;
+    (*p_preroll).p_data = NULL;
+    atomic_init (&(*p_preroll).busy, 0);
+
+    /* allocated and touched up front, the capture thread never pages it in; calloc alone hands out unfaulted zero pages */
+    if (nchunks > 0 && ((*p_preroll).p_data = (char*) calloc (nchunks, chunk_bytes)) == NULL)
+        return aw_handle_err (strerror (errno));
+
+    aw_prefault ((*p_preroll).p_data, (size_t) nchunks * chunk_bytes);
+
+    return 0;
+}
+
+int aw_preroll_free (AwPreroll* p_preroll)
+{
+    free ((*p_preroll).p_data);
+    (*p_preroll).p_data = NULL;
+
+    return 0;
+}
+
+/* where the next monitored period goes, NULL when disabled or still being drained */
+char* aw_preroll_chunk (AwPreroll* p_preroll)
+{
+    if ((*p_preroll).nchunks == 0 || atomic_load_explicit (&(*p_preroll).busy, memory_order_acquire))
+        return NULL;
+
+    return (*p_preroll).p_data + (size_t) (*p_preroll).next * (*p_preroll).chunk_bytes;
+}
+
+int aw_preroll_advance (AwPreroll* p_preroll)
+{
+    (*p_preroll).next = ((*p_preroll).next + 1) % (*p_preroll).nchunks;
+
+    if ((*p_preroll).filled < (*p_preroll).nchunks)
+        (*p_preroll).filled++;
+
+    return 0;
+}
+
+static int aw_wav_begin (AwWriter* p_writer)
+{
+    (*p_writer).data_size = 0;
+    (*p_writer).rf64 = 0;
+
+    return aw_wav_write_header (*(*p_writer).p_p_f, (*p_writer).p_params);
+}
+
+/* ALSA pads S24_LE in the low bits, wav wants the valid bits on top: shifted in place, the slot is the writer's until released */
+static void aw_wav_justify (char* p_buffer, size_t nsamples, int shift)
+{
+    uint32_t* p_sample = (uint32_t*) p_buffer;
+    size_t i;
+
+    for (i = 0; i < nsamples; i++)
+        p_sample[i] <<= shift;
+}
+
+static int aw_wav_write (AwWriter* p_writer, char* p_buffer, snd_pcm_uframes_t nframes)
+{
+    AwPcmParams* p_params = (*p_writer).p_params;
+
+    if ((*p_params).real_bits == 32 && (*p_params).nominal_bits < 32)
+        aw_wav_justify (p_buffer, (size_t) nframes * (*p_params).nchannels, 32 - (*p_params).nominal_bits);
+
+    if (fwrite (p_buffer, (*(*p_writer).p_params).framesize, nframes, *(*p_writer).p_p_f) != nframes)
+        return aw_handle_err (strerror (errno));
+
+    (*p_writer).data_size += (uint64_t) nframes * (*(*p_writer).p_params).framesize;
+
+    /* relabel as RF64 as soon as the take crosses 4 GiB, a crash later still leaves a valid file */
+    if (!(*p_writer).rf64 && aw_wav_needs_rf64 ((*p_writer).p_params, (*p_writer).data_size))
+    {
+        aw_wav_patch_header (*(*p_writer).p_p_f, (*p_writer).p_params, (*p_writer).data_size, 1);
+        (*p_writer).rf64 = 1;
+    }
+    return 0;
+}
+
+static int aw_wav_end (AwWriter* p_writer)
+{
+    return aw_wav_finalize (*(*p_writer).p_p_f, (*p_writer).p_params, (*p_writer).data_size);
+}
+
+/* indexed by aw_save_format_t */
+static const AwEncoder aw_encoders[] = {
+
+    { aw_wav_begin, aw_wav_write, aw_wav_end },
+    { aw_mp3_begin, aw_mp3_write, aw_mp3_end },
+    { aw_flac_begin, aw_flac_write, aw_flac_end }
+};
+
+const char* aw_save_extension (aw_save_format_t format)
+{
+    if (format == AW_SAVE_MP3) return "mp3";
+    if (format == AW_SAVE_FLAC) return "flac";
+
+    return "wav";
+}
+
+int aw_segment_path (char* path, size_t size, const char* prefix, uint32_t segment, aw_save_format_t format)
+{
+    return snprintf (path, size, "%s-%03u.%s", prefix, segment, aw_save_extension (format));
+}
+
+int aw_writer_start (AwWriter* p_writer, AwPcmParams* p_hw_params, uint32_t depth, double preroll, FILE** p_p_f)
+{
+    int err;
+    size_t slot_bytes = (size_t) (*p_hw_params).period_size * (*p_hw_params).framesize;
+
+    if (aw_ring_init (&(*p_writer).ring, depth, slot_bytes) < 0)
+        return aw_handle_err ("cannot allocate period ring");
+
+    if (aw_preroll_init (&(*p_writer).preroll, ceil (preroll * (*p_hw_params).framerate / (*p_hw_params).period_size), slot_bytes) < 0)
+        return aw_handle_err ("cannot allocate preroll");
+
+    /* all formats are signed, zero bytes are silence */
+    if (((*p_writer).p_silence = calloc (1, slot_bytes)) == NULL)
+        return aw_handle_err (strerror (errno));
+
+    (*p_writer).p_p_f = p_p_f;
+    (*p_writer).p_params = p_hw_params;
+    (*p_writer).format = AW_SAVE_WAV;
+    (*p_writer).p_encoder = NULL;
+    (*p_writer).flac_threads = AW_FLAC_DEFAULT_THREADS;
+    (*p_writer).rotate_frames = 0;
+    (*p_writer).rotate_bytes = 0;
+    (*p_writer).p_next_f = NULL;
+    (*p_writer).data_size = 0;
+    (*p_writer).in_take = 0;
+    atomic_init (&(*p_writer).running, 1);
+
+    if (sem_init (&(*p_writer).sem_data, 0, 0) < 0 || sem_init (&(*p_writer).sem_end, 0, 0) < 0)
+        return aw_handle_err (strerror (errno));
+
+    if ((err = pthread_create (&(*p_writer).thread_id, NULL, aw_writer_thread_func, (void*) p_writer)) != 0)
+        return aw_handle_err (strerror (err));
+
+    return 0;
+}
+
+/* block until the writer has flushed the take closed by an AW_SLOT_END */
+int aw_writer_wait_end (AwWriter* p_writer)
+{
+    struct timespec deadline;
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += AW_WRITER_END_TIMEOUT;
+
+    while (sem_timedwait (&(*p_writer).sem_end, &deadline) < 0)
+        if (errno != EINTR)
+            return aw_handle_err ("writer did not close the take in time");
+
+    return 0;
+}
+
+int aw_writer_stop (AwWriter* p_writer)
+{
+    atomic_store (&(*p_writer).running, 0);
+    sem_post (&(*p_writer).sem_data);
+    
+    pthread_join ((*p_writer).thread_id, NULL);
+
+    sem_destroy (&(*p_writer).sem_data);
+    sem_destroy (&(*p_writer).sem_end);
+    aw_ring_free (&(*p_writer).ring);
+    aw_preroll_free (&(*p_writer).preroll);
+    free ((*p_writer).p_silence);
+
+    return 0;
+}
+
+/*
+ * rotation happens here between two slots, so segments split on period boundaries with nothing lost or repeated.
+ * the next segment is opened (and for wav reserved on disk) right after each handover, never at the boundary.
+*/
+
+static FILE* aw_writer_open_segment (AwWriter* p_writer, uint32_t segment)
+{
+    char path[sizeof (*p_writer).rotate_prefix + 16];
+    FILE* p_f;
+    off_t reserve;
+
+    aw_segment_path (path, sizeof path, (*p_writer).rotate_prefix, segment, (*p_writer).format);
+
+    if ((p_f = fopen (path, "wb")) == NULL)
+    {
+        aw_handle_err (strerror (errno));
+        return NULL;
+    }
+
+    /* keep size: the file grows over the reservation, see aw_writer_trim for the unused tail */
+    if ((*p_writer).format == AW_SAVE_WAV)
+    {
+        reserve = (*p_writer).rotate_bytes;
+
+        if (reserve == 0 || ((*p_writer).rotate_frames > 0 && (*p_writer).rotate_frames * (*(*p_writer).p_params).framesize < reserve))
+            reserve = (*p_writer).rotate_frames * (*(*p_writer).p_params).framesize;
+
+        if (reserve > 0)
+            fallocate (fileno (p_f), FALLOC_FL_KEEP_SIZE, 0, reserve + AW_WAV_HEADER_MAX);
+    }
+    return p_f;
+}
+
+/* gives back what the reservation left past the end of a finished segment, it stays allocated after fclose otherwise */
+static int aw_writer_trim (AwWriter* p_writer)
+{
+    struct stat st;
+    FILE* p_f = *(*p_writer).p_p_f;
+
+    if ((*p_writer).format != AW_SAVE_WAV || ((*p_writer).rotate_frames == 0 && (*p_writer).rotate_bytes == 0))
+        return 0;
+
+    if (fflush (p_f) == EOF || fstat (fileno (p_f), &st) < 0 || ftruncate (fileno (p_f), st.st_size) < 0)
+        return aw_handle_err (strerror (errno));
+
+    return 0;
+}
+
+static int aw_writer_rotate (AwWriter* p_writer)
+{
+    FILE* p_next_f = (*p_writer).p_next_f;
+
+    if (p_next_f == NULL && (p_next_f = aw_writer_open_segment (p_writer, (*p_writer).segment + 1)) == NULL)
+        return aw_handle_err ("cannot open next segment, going on with the current one");
+
+    (*(*p_writer).p_encoder).p_end (p_writer);
+    aw_writer_trim (p_writer);
+
+    if (fclose (*(*p_writer).p_p_f) == EOF)
+        aw_handle_err (strerror (errno));
+
+    *(*p_writer).p_p_f = p_next_f;
+    (*p_writer).segment++;
+    (*p_writer).segment_frames = 0;
+
+    if ((*(*p_writer).p_encoder).p_begin (p_writer) < 0)
+        (*p_writer).in_take = -1;
+
+    (*p_writer).p_next_f = aw_writer_open_segment (p_writer, (*p_writer).segment + 1);
+
+    return 0;
+}
+
+static int aw_writer_write (AwWriter* p_writer, char* p_buffer, snd_pcm_uframes_t nframes)
+{
+    int err = (*(*p_writer).p_encoder).p_write (p_writer, p_buffer, nframes);
+
+    (*p_writer).segment_frames += nframes;
+
+    if (((*p_writer).rotate_frames > 0 && (*p_writer).segment_frames >= (*p_writer).rotate_frames)
+        || ((*p_writer).rotate_bytes > 0 && (*p_writer).data_size >= (*p_writer).rotate_bytes))
+        aw_writer_rotate (p_writer);
+
+    return err;
+}
+
+/* silence for frames the capture lost, keeps the take aligned to the wall clock */
+static int aw_writer_fill_gap (AwWriter* p_writer, snd_pcm_uframes_t nframes)
+{
+    snd_pcm_uframes_t chunk;
+
+    while (nframes > 0 && (*p_writer).in_take == 1)
+    {
+        chunk = nframes < (*(*p_writer).p_params).period_size ? nframes : (*(*p_writer).p_params).period_size;
+        aw_writer_write (p_writer, (*p_writer).p_silence, chunk);
+        nframes -= chunk;
+    }
+    return 0;
+}
+
+/* write the oldest nchunks periods of the preroll, then give it back to the capture thread */
+static int aw_writer_drain_preroll (AwWriter* p_writer, uint32_t nchunks)
+{
+    AwPreroll* p_preroll = &(*p_writer).preroll;
+    uint32_t chunk = ((*p_preroll).next + (*p_preroll).nchunks - nchunks) % (*p_preroll).nchunks;
+    uint32_t i;
+
+    for (i = 0; i < nchunks && (*p_writer).in_take == 1; i++)
+    {
+        aw_writer_write (p_writer, (*p_preroll).p_data + (size_t) chunk * (*p_preroll).chunk_bytes, (*(*p_writer).p_params).period_size);
+        chunk = (chunk + 1) % (*p_preroll).nchunks;
+    }
+    atomic_store_explicit (&(*p_preroll).busy, 0, memory_order_release);
+
+    return 0;
+}
+
+void* aw_writer_thread_func (void* p_writer_)
+{
+    AwWriter* p_writer = (AwWriter*) p_writer_;
+    char* p_slot;
+    aw_slot_kind_t kind;
+    snd_pcm_uframes_t nframes;
+    char path[sizeof (*p_writer).rotate_prefix + 16];
+
+    while (1)
+    {
+        sem_wait (&(*p_writer).sem_data);
+
+        while ((p_slot = aw_ring_peek (&(*p_writer).ring, &kind, &nframes)) != NULL)
+        {
+            if (kind == AW_SLOT_DATA || kind == AW_SLOT_PREROLL || kind == AW_SLOT_GAP)
+            {
+                /* a take that fails to begin is dropped until its end marker */
+                if (!(*p_writer).in_take)
+                {
+                    (*p_writer).p_encoder = &aw_encoders[(*p_writer).format];
+                    (*p_writer).in_take = (*(*p_writer).p_encoder).p_begin (p_writer) == 0 ? 1 : -1;
+                    (*p_writer).segment = 1;
+                    (*p_writer).segment_frames = 0;
+
+                    if ((*p_writer).rotate_frames > 0 || (*p_writer).rotate_bytes > 0)
+                        (*p_writer).p_next_f = aw_writer_open_segment (p_writer, 2);
+                }
+                if (kind == AW_SLOT_PREROLL)
+                    aw_writer_drain_preroll (p_writer, nframes);
+
+                else if (kind == AW_SLOT_GAP)
+                    aw_writer_fill_gap (p_writer, nframes);
+
+                else if ((*p_writer).in_take == 1)
+                    aw_writer_write (p_writer, p_slot, nframes);
+
+            } else if (kind == AW_SLOT_END) {
+
+                if ((*p_writer).in_take == 1)
+                    (*(*p_writer).p_encoder).p_end (p_writer);
+
+                // a stop that came early leaves most of the reservation unused
+                if ((*p_writer).in_take != 0)
+                    aw_writer_trim (p_writer);
+
+                /* the spare segment was never used */
+                if ((*p_writer).p_next_f != NULL)
+                {
+                    fclose ((*p_writer).p_next_f);
+                    aw_segment_path (path, sizeof path, (*p_writer).rotate_prefix, (*p_writer).segment + 1, (*p_writer).format);
+                    remove (path);
+                    (*p_writer).p_next_f = NULL;
+                }
+                    
+                (*p_writer).in_take = 0;
+                sem_post (&(*p_writer).sem_end);
+            }
+            aw_ring_release (&(*p_writer).ring);
+        }
+        if (!atomic_load (&(*p_writer).running)) break;
+    }
+    return NULL;
+}
+
+
+/*============================================================================
+                record cycle and compute
+============================================================================*/
+
+
+/* close the current bin: slide it into the window sums in O(1) */
+static void aw_meter_push_bin (AwPcmParams* p_params, AwComputeStruct* p_ss)
+{
+    int channel_i;
+    uint32_t bin_i;
+    double* p_bins;
+    double power;
+
+    for (channel_i = 0; channel_i < (*p_params).nchannels; channel_i++)
+    {
+        p_bins = (*p_ss).bins + channel_i * (*p_ss).meter_nbins;
+        power = (*p_ss).sum_power[channel_i] / (*p_ss).sum_nframes;
+
+        (*p_ss).window_power[channel_i] += power - p_bins[(*p_ss).meter_bin];
+        p_bins[(*p_ss).meter_bin] = power;
+        (*p_ss).sum_power[channel_i] = 0;
+    }
+    (*p_ss).sum_nframes = 0;
+
+    if (++(*p_ss).meter_bin < (*p_ss).meter_nbins)
+        return;
+
+    /* once per window the sums are rebuilt, so rounding never accumulates */
+    (*p_ss).meter_bin = 0;
+
+    for (channel_i = 0; channel_i < (*p_params).nchannels; channel_i++)
+    {
+        p_bins = (*p_ss).bins + channel_i * (*p_ss).meter_nbins;
+        (*p_ss).window_power[channel_i] = 0;
+
+        for (bin_i = 0; bin_i < (*p_ss).meter_nbins; bin_i++)
+            (*p_ss).window_power[channel_i] += p_bins[bin_i];
+    }
+}
+
+int aw_build_compute_struct (AwPcmParams hw_params, AwComputeStruct* p_ss)
+{
+    /* the window is fixed in time, whatever period and buffer the device granted */
+    (*p_ss).meter_nbins = AW_METER_WINDOW / AW_METER_BIN;
+    (*p_ss).meter_bin = 0;
+    (*p_ss).bin_frames = hw_params.framerate * AW_METER_BIN / 1000;
+    
+    if ((*p_ss).bin_frames == 0) (*p_ss).bin_frames = 1;
+
+    if (((*p_ss).bins = (double*) calloc (hw_params.nchannels * (*p_ss).meter_nbins, sizeof (double))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).window_power = (double*) calloc (hw_params.nchannels, sizeof (double))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).avg_power = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).avg_log = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).max = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).clip = (int*) calloc (hw_params.nchannels, sizeof (int))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).sum_power = (double*) calloc (hw_params.nchannels, sizeof (double))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).peaks = (uint32_t*) calloc (hw_params.nchannels, sizeof (uint32_t))) == NULL) aw_handle_err (strerror (errno));
+    if (((*p_ss).sumsqs = (uint64_t*) calloc (hw_params.nchannels, sizeof (uint64_t))) == NULL) aw_handle_err (strerror (errno));
+    (*p_ss).sum_nframes = 0;
+    (*p_ss).xruns = 0;
+    (*p_ss).short_reads = 0;
+    (*p_ss).lost_frames = 0;
+
+    return 0;
+}
+
+int aw_free_compute_struct (AwComputeStruct* p_ss) {
+
+    free (p_ss->bins);
+    free (p_ss->window_power);
+    free (p_ss->avg_power);
+    free (p_ss->avg_log);
+    free (p_ss->max);
+    free (p_ss->clip);
+    free (p_ss->sum_power);
+    free (p_ss->peaks);
+    free (p_ss->sumsqs);
+}
+
+int aw_compute (void* p_buffer, snd_pcm_uframes_t nframes, AwPcmParams* p_params, AwComputeStruct* p_ss)
+{
+    int channel_i;
+    float nvalue;
+    snd_pcm_uframes_t block;
+    char* p_block = (char*) p_buffer;
+
+    while (nframes > 0)
+    {
+        /* blocks never straddle a meter bin */
+        block = nframes < AW_KERNEL_BLOCK ? nframes : AW_KERNEL_BLOCK;
+
+        if (block > (*p_ss).bin_frames - (*p_ss).sum_nframes)
+            block = (*p_ss).bin_frames - (*p_ss).sum_nframes;
+
+        memset ((*p_ss).peaks, 0, (*p_params).nchannels * sizeof (uint32_t));
+        memset ((*p_ss).sumsqs, 0, (*p_params).nchannels * sizeof (uint64_t));
+
+        (*(*p_params).p_kernel) (p_block, block, (*p_params).nchannels, (*p_ss).peaks, (*p_ss).sumsqs);
+
+        for (channel_i = 0; channel_i < (*p_params).nchannels; channel_i++)
+        {        
+            nvalue = (*p_ss).peaks[channel_i] * 100.0 / (*p_params).max;  
+
+            if (nvalue >= 100) 
+            {
+                nvalue = 100;
+                (*p_ss).clip[channel_i] = 1;
+            }
+            if (nvalue > (*p_ss).max[channel_i]) (*p_ss).max[channel_i] = nvalue;
+
+            (*p_ss).sum_power[channel_i] += (*p_ss).sumsqs[channel_i] * (*p_params).power_scale;
+        }
+        p_block += block * (*p_params).framesize;
+        nframes -= block;
+
+        if (((*p_ss).sum_nframes += block) == (*p_ss).bin_frames)
+            aw_meter_push_bin (p_params, p_ss);
+    }
+    return 0;
+}
+
+/* publish the window rms to the meters, the window itself slides in aw_compute */
+int aw_compute_flush (AwPcmParams* p_params, AwComputeStruct* p_ss)
+{
+    int channel_i;
+    double power;
+
+    for (channel_i = 0; channel_i < (*p_params).nchannels; channel_i++)
+    {        
+        power = (*p_ss).window_power[channel_i] / (*p_ss).meter_nbins;
+        (*p_ss).avg_power[channel_i] = power > 0 ? sqrt (power) : 0;
+        
+        if ((*p_ss).avg_power[channel_i] > 1)
+        {
+            (*p_ss).avg_log[channel_i] = 20 * log10 ((*p_ss).avg_power[channel_i]) / 40 * 100;
+
+        } else {
+
+            (*p_ss).avg_log[channel_i] = 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * snd_pcm_wait that also returns when wake_fd (-1 for none) becomes readable.
+ * 1 when the pcm is ready, 0 on timeout, -ECANCELED when woken, a negative alsa error otherwise.
+*/
+int aw_pcm_wait (snd_pcm_t* p_pcm, int wake_fd, int timeout)
+{
+    struct pollfd fds[AW_MAX_POLL_FDS + 1];
+    unsigned short revents;
+    int nfds;
+    int err;
+
+    switch (snd_pcm_state (p_pcm))
+    {
+        case SND_PCM_STATE_XRUN:
+            return -EPIPE;
+        case SND_PCM_STATE_SUSPENDED:
+            return -ESTRPIPE;
+        case SND_PCM_STATE_DISCONNECTED:
+            return -ENODEV;
+        default:
+            break;
+    }
+
+    if ((nfds = snd_pcm_poll_descriptors (p_pcm, fds, AW_MAX_POLL_FDS)) < 0)
+        return nfds;
+
+    fds[nfds].fd = wake_fd;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+
+    if ((err = poll (fds, nfds + 1, timeout)) < 0)
+        return errno == EINTR ? 0 : -errno;
+    if (err == 0)
+        return 0;
+
+    if (fds[nfds].revents & POLLIN)
+        return -ECANCELED;
+
+    if ((err = snd_pcm_poll_descriptors_revents (p_pcm, fds, nfds, &revents)) < 0)
+        return err;
+
+    if (revents & (POLLERR | POLLNVAL))
+        return snd_pcm_state (p_pcm) == SND_PCM_STATE_XRUN ? -EPIPE : -EIO;
+
+    return (revents & POLLIN) ? 1 : 0;
+}
+
+/* read one period in mmap mode: meter in place on the dma area and copy out only if p_dest is given */
+snd_pcm_sframes_t aw_mmap_read (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, char* p_dest, snd_pcm_uframes_t* p_nframes, AwComputeStruct* p_ss, int wake_fd)
+{
+    int err;
+    const snd_pcm_channel_area_t* p_areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t nframes;
+    snd_pcm_uframes_t done = 0;
+    snd_pcm_sframes_t avail;
+    char* p_dma;
+
+    /* p_nframes counts what was delivered, also when an xrun cuts the read short */
+    *p_nframes = 0;
+
+    while (done < (*p_hw_params).period_size)
+    {
+        if ((avail = snd_pcm_avail_update (p_pcm)) < 0)
+            return avail;
+
+        nframes = (*p_hw_params).period_size - done;
+
+        if (avail < nframes)
+        {
+            if ((err = aw_pcm_wait (p_pcm, wake_fd, 1000)) < 0)
+                return err;
+            if (err == 0)
+                return -EIO;
+            continue;
+        }
+        if ((err = snd_pcm_mmap_begin (p_pcm, &p_areas, &offset, &nframes)) < 0)
+            return err;
+
+        p_dma = (char*) p_areas[0].addr + (p_areas[0].first + offset * p_areas[0].step) / 8;
+
+        aw_compute (p_dma, nframes, p_hw_params, p_ss);
+
+        if (p_dest != NULL)
+            memcpy (p_dest + done * (*p_hw_params).framesize, p_dma, nframes * (*p_hw_params).framesize);
+
+        if ((avail = snd_pcm_mmap_commit (p_pcm, offset, nframes)) < 0)
+            return avail;
+        if (avail != nframes)
+            return -EPIPE;
+
+        done += nframes;
+        *p_nframes = done;
+    }
+    return done;
+}
+
+/* called by the capture thread, the log is read by the gui */
+int aw_account_xrun (AwComputeStruct* p_ss, snd_pcm_uframes_t lost_frames)
+{
+    AwXrun* p_xrun = &(*p_ss).xrun_log[(*p_ss).xruns % AW_XRUN_LOG_LENGTH];
+
+    clock_gettime (CLOCK_REALTIME, &(*p_xrun).when);
+    (*p_xrun).lost_frames = lost_frames;
+    (*p_ss).lost_frames += lost_frames;
+    (*p_ss).xruns++;
+
+    return 0;
+}
+
+/*
+ * prepares and starts the streams; those snd_pcm_link can tie to the first one start on its trigger,
+ * and an xrun then restarts them together. the start times are kept to align the takes.
+*/
+int aw_streams_start (AwStream* p_streams, int nstreams)
+{
+    snd_pcm_status_t* p_status = NULL;
+    int linked[AW_MAX_STREAMS] = { 0 };
+    int err;
+    int i;
+
+    for (i = 0; i < nstreams; i++)
+    {
+        if ((err = snd_pcm_prepare (p_streams[i].p_pcm)) < 0)
+            return aw_handle_err (snd_strerror (err));
+    }
+
+    for (i = 1; i < nstreams; i++)
+    {
+        linked[i] = snd_pcm_link (p_streams[0].p_pcm, p_streams[i].p_pcm) == 0;
+        linked[0] |= linked[i];
+    }
+    for (i = 0; i < nstreams; i++)
+        p_streams[i].linked = linked[i];
+
+    for (i = 0; i < nstreams; i++)
+    {
+        if (!linked[i] && (err = snd_pcm_start (p_streams[i].p_pcm)) < 0)
+            return aw_handle_err (snd_strerror (err));
+    }
+
+    snd_pcm_status_malloc (&p_status);
+
+    for (i = 0; i < nstreams; i++)
+    {
+        p_streams[i].start.tv_sec = 0;
+        p_streams[i].start.tv_nsec = 0;
+
+        if (p_status != NULL && snd_pcm_status (p_streams[i].p_pcm, p_status) == 0)
+            snd_pcm_status_get_trigger_htstamp (p_status, &p_streams[i].start);
+
+        // plugins without timestamps: the time it started is close enough
+        if (p_streams[i].start.tv_sec == 0)
+            clock_gettime (CLOCK_REALTIME, &p_streams[i].start);
+
+        if (i > 0)
+            printf ("stream %d %s\n", i, linked[i] ? "linked to stream 0" : "started on its own");
+    }
+    if (p_status != NULL)
+        snd_pcm_status_free (p_status);
+
+    return 0;
+}
+
+/* wall clock time of a stream frame */
+static void aw_stream_time (AwStream* p_stream, uint64_t frame, struct timespec* p_time)
+{
+    uint32_t framerate = (*(*p_stream).p_hw_params).framerate;
+
+    // whole seconds apart, frame * 1e9 would overflow in about a day at high rates
+    uint64_t nsec = (*p_stream).start.tv_nsec + frame % framerate * 1000000000ULL / framerate;
+
+    (*p_time).tv_sec = (*p_stream).start.tv_sec + frame / framerate + nsec / 1000000000ULL;
+    (*p_time).tv_nsec = nsec % 1000000000ULL;
+}
+
+/* what a stream held when it stopped, taken before a recovery drops it */
+static void aw_stream_stopped (AwStream* p_stream, snd_pcm_status_t* p_status)
+{
+    (*p_stream).stop_avail = 0;
+    (*p_stream).stop_time.tv_sec = 0;
+    (*p_stream).stop_time.tv_nsec = 0;
+
+    if (snd_pcm_status ((*p_stream).p_pcm, p_status) < 0)
+        return;
+
+    (*p_stream).stop_avail = snd_pcm_status_get_avail (p_status);
+
+    // stopped by the xrun: the trigger time is when the hw pointer froze, otherwise it is still running now
+    if (snd_pcm_status_get_state (p_status) == SND_PCM_STATE_XRUN || snd_pcm_status_get_state (p_status) == SND_PCM_STATE_SUSPENDED)
+        snd_pcm_status_get_trigger_htstamp (p_status, &(*p_stream).stop_time);
+    else
+        snd_pcm_status_get_htstamp (p_status, &(*p_stream).stop_time);
+}
+
+/*
+ * frames lost by a recovery, counted by the device: the ones it held unread when it stopped,
+ * plus the ones it did not capture between that stop and the restart
+*/
+static void aw_stream_lost (AwStream* p_stream, snd_pcm_status_t* p_status, aw_record_state_t state)
+{
+    uint32_t framerate = (*(*p_stream).p_hw_params).framerate;
+    struct timespec start = { 0, 0 };
+    snd_pcm_uframes_t lost = (*p_stream).stop_avail;
+    int64_t nsec;
+
+    if (snd_pcm_status ((*p_stream).p_pcm, p_status) == 0)
+        snd_pcm_status_get_trigger_htstamp (p_status, &start);
+
+    if ((*p_stream).stop_time.tv_sec != 0 && start.tv_sec != 0)
+    {
+        nsec = (int64_t) (start.tv_sec - (*p_stream).stop_time.tv_sec) * 1000000000LL + (start.tv_nsec - (*p_stream).stop_time.tv_nsec);
+
+        if (nsec > 0)
+            lost += nsec / 1000000000LL * framerate + nsec % 1000000000LL * framerate / 1000000000LL;
+    }
+    aw_account_xrun ((*p_stream).p_ss, lost);
+    (*p_stream).position += lost;
+
+    if (state == AW_RECORDING)
+        (*p_stream).gap += lost;
+
+    // a pre-roll with a hole in it would splice silence into the next take's lead-in: it starts over
+    else if (state == AW_MONITORING)
+        (*(*p_stream).p_writer).preroll.filled = 0;
+}
+
+/*
+ * recovers stream i after a failed read. recovering a linked stream prepares and restarts the whole group,
+ * so every stream in it loses what it held and the span until the restart.
+*/
+static int aw_streams_recover (AwStream* p_streams, int nstreams, int i, aw_record_state_t state)
+{
+    snd_pcm_status_t* p_status;
+    int err = p_streams[i].xrun;
+    int j;
+
+    snd_pcm_status_alloca (&p_status);
+    p_streams[i].xrun = 0;
+
+    for (j = 0; j < nstreams; j++)
+    {
+        if (j == i || (p_streams[i].linked && p_streams[j].linked))
+            aw_stream_stopped (&p_streams[j], p_status);
+    }
+
+    if (snd_pcm_recover (p_streams[i].p_pcm, err, 1) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    /* recovered means prepared: a capture pcm raises no POLLIN until started, in either access */
+    if (snd_pcm_start (p_streams[i].p_pcm) < 0)
+        return aw_handle_err (snd_strerror (err));
+
+    for (j = 0; j < nstreams; j++)
+    {
+        if (j == i || (p_streams[i].linked && p_streams[j].linked))
+            aw_stream_lost (&p_streams[j], p_status, state);
+    }
+    return 0;
+}
+
+/* one period of a stream whose pcm is ready, see aw_streams_cycle; 1 when its pcm needs aw_streams_recover */
+static int aw_stream_read (AwStream* p_stream, aw_record_state_t state, int wake_fd)
+{
+    snd_pcm_t* p_pcm = (*p_stream).p_pcm;
+    AwPcmParams* p_hw_params = (*p_stream).p_hw_params;
+    AwWriter* p_writer = (*p_stream).p_writer;
+    AwComputeStruct* p_ss = (*p_stream).p_ss;
+    char* p_buffer;
+    char* p_preroll;
+    snd_pcm_sframes_t nframes_or_err;
+    snd_pcm_uframes_t nframes;
+    int overflow = 0;
+
+    /* read straight into a ring slot while recording, the writer thread does the disk i/o */
+
+    p_buffer = NULL;
+    p_preroll = NULL;
+
+    if (state == AW_RECORDING)
+    {
+        /* the preroll goes first, the period read now follows its last one; it is dropped if the ring is full */
+        if (!(*p_stream).take_open)
+        {
+            aw_stream_time (p_stream, (*p_stream).position - (uint64_t) (*p_writer).preroll.filled * (*p_hw_params).period_size, &(*p_ss).take_start);
+
+            if ((*p_writer).preroll.filled > 0)
+            {
+                if (aw_ring_reserve (&(*p_writer).ring) != NULL)
+                {
+                    atomic_store_explicit (&(*p_writer).preroll.busy, 1, memory_order_relaxed);
+                    aw_ring_commit (&(*p_writer).ring, AW_SLOT_PREROLL, (*p_writer).preroll.filled);
+                    sem_post (&(*p_writer).sem_data);
+                }
+                (*p_writer).preroll.filled = 0;
+            }
+        }
+        (*p_stream).take_open = 1;
+
+        /* frames lost since the last slot go in first as silence */
+        if ((*p_stream).gap > 0 && aw_ring_reserve (&(*p_writer).ring) != NULL)
+        {
+            aw_ring_commit (&(*p_writer).ring, AW_SLOT_GAP, (*p_stream).gap);
+            sem_post (&(*p_writer).sem_data);
+            (*p_stream).gap = 0;
+        }
+        if ((p_buffer = aw_ring_reserve (&(*p_writer).ring)) == NULL)
+        {
+            atomic_fetch_add_explicit (&(*p_writer).ring.overflows, 1, memory_order_relaxed);
+            overflow = 1;
+        }
+
+    } else if (state == AW_MONITORING) {
+
+        p_preroll = p_buffer = aw_preroll_chunk (&(*p_writer).preroll);
+    }
+    if (p_buffer == NULL)
+        p_buffer = (*p_stream).p_scratch;
+
+    /* only the frames actually delivered are metered and kept */
+    if ((*p_hw_params).access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+    {
+        nframes_or_err = aw_mmap_read (p_pcm, p_hw_params, p_buffer != (*p_stream).p_scratch ? p_buffer : NULL, &nframes, p_ss, wake_fd);
+
+    } else {
+
+        nframes_or_err = snd_pcm_readi (p_pcm, p_buffer, (*p_hw_params).period_size);
+        nframes = nframes_or_err > 0 ? nframes_or_err : 0;
 
-    snd_pcm_hw_params_free (p_alsa_hw_params);
+        if (nframes > 0 && aw_compute (p_buffer, nframes, p_hw_params, p_ss) < 0)
+            return aw_handle_err ("error in computing");
+    }
+    (*p_stream).position += nframes;
 
-    return 0;
-}
+    /* a full ring drops what was read into scratch, no more and no less */
+    if (overflow)
+        (*p_stream).gap += nframes;
 
-int aw_print_params (AwPcmParams hw_params)
-{   
-    printf ("\nHW PARAMS\n\n");
+    /* woken by aw_thread_stop, the state says what comes next */
+    if (nframes_or_err == -ECANCELED)
+        return 0;
 
-    printf ("nchannels: %d\n", hw_params.nchannels);
-    printf ("framerate: %d\n", hw_params.framerate);
-    printf ("format: %s\n", snd_pcm_format_name (hw_params.format));
-    printf ("is_signed: %s\n", hw_params.is_signed ? "true" : "false");
-    printf ("is_little_endian: %s\n", hw_params.is_little_endian ? "true" : "false");
-    printf ("nominal_bits: %d\n", hw_params.nominal_bits);
-    printf ("real_bits: %d\n", hw_params.real_bits);
-    printf ("samplesize: %d\n", hw_params.samplesize);
-    printf ("samplerate: %d\n", hw_params.samplerate);
-    printf ("framesize: %d\n", hw_params.framesize);
-    printf ("byterate: %d\n", hw_params.byterate);
-    printf ("max: %d\n", hw_params.max);
-    printf ("period_size: %ld\n", hw_params.period_size);
-    printf ("buffer_size: %ld\n", hw_params.buffer_size);
-    printf ("description: %s\n", hw_params.description);
+    /* what was delivered before the error is kept, the recovery comes after */
+    if (nframes_or_err < 0)
+        (*p_stream).xrun = nframes_or_err;
 
-    return 0;
-}
+    else if (nframes < (*p_hw_params).period_size)
+        (*p_ss).short_reads++;
 
+    aw_compute_flush (p_hw_params, p_ss);
+    
+    if (p_preroll != NULL)
+    {
+        if (nframes == (*p_hw_params).period_size)
+            aw_preroll_advance (&(*p_writer).preroll);
 
-/*============================================================================
-                record cycle and compute
-============================================================================*/
+    } else if (p_buffer != (*p_stream).p_scratch && nframes > 0) {
 
+        aw_ring_commit (&(*p_writer).ring, AW_SLOT_DATA, nframes);
+        sem_post (&(*p_writer).sem_data);
+    }
 
-float aw_queue_cycle (AwComputeStruct* p_ss, int channel_i, float entry)
-{
-    float* p_first;
-    float first;
+    /* close the take once out of recording/pause, retried next period if the ring is full */
 
-    p_first = (*p_ss).avgs_queue + channel_i * (*p_ss).avgs_queue_length + (*p_ss).avgs_queue_start;
+    if ((*p_stream).take_open && state == AW_MONITORING && aw_ring_reserve (&(*p_writer).ring) != NULL)
+    {
+        aw_ring_commit (&(*p_writer).ring, AW_SLOT_END, 0);
+        sem_post (&(*p_writer).sem_data);
+        (*p_stream).take_open = 0;
+        (*p_stream).gap = 0;
+    }
 
-    first = *p_first;
-    *p_first = entry;    
-    ((*p_ss).avgs_queue_start == 0) ? (*p_ss).avgs_queue_start = (*p_ss).avgs_queue_length - 1 : (*p_ss).avgs_queue_start--;
-    ((*p_ss).avgs_queue_end == 0) ? (*p_ss).avgs_queue_end = (*p_ss).avgs_queue_length - 1 : (*p_ss).avgs_queue_end--;
+    (*p_ss).ring_high_water = atomic_load_explicit (&(*p_writer).ring.high_water, memory_order_relaxed);
+    (*p_ss).ring_overflows = atomic_load_explicit (&(*p_writer).ring.overflows, memory_order_relaxed);
 
-    return first;
+    return (*p_stream).xrun != 0;
 }
 
-int aw_build_compute_struct (AwPcmParams hw_params, AwComputeStruct* p_ss)
+/*
+ * services all the streams from one poll: each one is read a period at a time when its pcm is ready,
+ * into its own writer and meters. wake_fd (-1 for none) interrupts the poll, see aw_thread_stop.
+*/
+int aw_streams_cycle (AwStream* p_streams, int nstreams, aw_atomic_state_t* p_state, int wake_fd)
 {
-    (*p_ss).avgs_queue_length = (uint32_t) ceil((hw_params.framerate * (float) AW_STAT_TIME / 1000000) / hw_params.buffer_size);
-    (*p_ss).avgs_queue_start = 0;
-    (*p_ss).avgs_queue_end = (*p_ss).avgs_queue_length - 1;
-    
-    if (((*p_ss).avgs_queue = (float*) calloc (hw_params.nchannels * (*p_ss).avgs_queue_length, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
-    if (((*p_ss).avg_power = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
-    if (((*p_ss).avg_log = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
-    if (((*p_ss).max = (float*) calloc (hw_params.nchannels, sizeof (float))) == NULL) aw_handle_err (strerror (errno));
-    if (((*p_ss).clip = (int*) calloc (hw_params.nchannels, sizeof (int))) == NULL) aw_handle_err (strerror (errno));
+    struct pollfd fds[AW_MAX_STREAMS * AW_MAX_POLL_FDS + 1];
+    int first[AW_MAX_STREAMS + 1];
+    unsigned short revents;
+    aw_record_state_t state;
+    int nfds;
+    int err = 0;
+    int i;
 
-    return 0;
-}
+    for (i = 0; i < nstreams; i++)
+    {
+        if ((p_streams[i].p_scratch = malloc (snd_pcm_frames_to_bytes (p_streams[i].p_pcm, (*p_streams[i].p_hw_params).period_size))) == NULL)
+        {
+            while (i-- > 0)
+                free (p_streams[i].p_scratch);
+            return aw_handle_err (strerror (errno));
+        }
+        aw_prefault (p_streams[i].p_scratch, snd_pcm_frames_to_bytes (p_streams[i].p_pcm, (*p_streams[i].p_hw_params).period_size));
+        p_streams[i].xrun = 0;
+        p_streams[i].take_open = 0;
+        p_streams[i].gap = 0;
+        p_streams[i].position = 0;
+    }
 
-int aw_free_compute_struct (AwComputeStruct* p_ss) {
+    while (err == 0 && ((state = atomic_load_explicit (p_state, memory_order_acquire)) == AW_RECORDING || state == AW_MONITORING || state == AW_PAUSED))
+    {
+        /* descriptors are taken each pass, a recovery may change them */
+        for (i = 0, nfds = 0; i < nstreams; i++)
+        {
+            first[i] = nfds;
 
-    free (p_ss->avgs_queue);
-    free (p_ss->avg_power);
-    free (p_ss->avg_log);
-    free (p_ss->max);
-    free (p_ss->clip);
-}
+            if ((err = snd_pcm_poll_descriptors (p_streams[i].p_pcm, fds + nfds, AW_MAX_POLL_FDS)) < 0)
+                break;
+            nfds += err;
+            err = 0;
+        }
+        if (err < 0)
+        {
+            aw_handle_err (snd_strerror (err));
+            break;
+        }
+        first[nstreams] = nfds;
 
-int aw_compute (void* p_buffer, AwPcmParams* p_params, AwComputeStruct* p_ss)
-{
-    int frame_i;
-    int channel_i;
-    int32_t value;
-    float nvalue;
-    double sum_power;
-    float in_avg;
-    float out_avg;
-    char* p_sample;
-    
-    for (channel_i = 0; channel_i < (*p_params).nchannels; channel_i++)
-    {        
-        sum_power = 0;
-        p_sample = ((char*) p_buffer);
-        p_sample += (*p_params).samplesize * channel_i;
-        
-        for (frame_i = 0; frame_i < (*p_params).buffer_size; frame_i++)
-        {   
-            value = (*(*p_params).p_parser) (p_sample);   
-            p_sample += (*p_params).framesize; 
-            nvalue = abs (value) * 100.0 / (*p_params).max;  
+        fds[nfds].fd = wake_fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
 
-            if (nvalue >= 100) 
+        if ((err = poll (fds, nfds + 1, 1000)) <= 0)
+        {
+            if (err == 0 || errno != EINTR)
             {
-                nvalue = 100;
-                (*p_ss).clip[channel_i] = 1;
+                err = aw_handle_err (err == 0 ? "no period in one second, capture stalled" : strerror (errno));
+                break;
             }
-            if (nvalue > (*p_ss).max[channel_i]) (*p_ss).max[channel_i] = nvalue;
+            err = 0;
+            continue;
+        }
+        err = 0;
+
+        if (fds[nfds].revents & POLLIN)
+            continue;
+
+        /* a stream in xrun reports POLLERR, its read recovers it */
+        for (i = 0; i < nstreams && err == 0; i++)
+        {
+            if (snd_pcm_poll_descriptors_revents (p_streams[i].p_pcm, fds + first[i], first[i + 1] - first[i], &revents) < 0)
+                continue;
 
-            sum_power += nvalue * nvalue;
+            if ((revents & (POLLIN | POLLERR)) && (err = aw_stream_read (&p_streams[i], state, wake_fd)) > 0)
+                err = aw_streams_recover (p_streams, nstreams, i, state);
         }
-        in_avg = sqrt ((sum_power / (*p_params).buffer_size)) / (*p_ss).avgs_queue_length;        
-        out_avg = aw_queue_cycle (p_ss, channel_i, in_avg);
-        
-        (*p_ss).avg_power[channel_i] += (in_avg - out_avg);
-        
-        if ((*p_ss).avg_power[channel_i] > 1)
+    }
+
+    for (i = 0; i < nstreams; i++)
+    {
+        while (p_streams[i].take_open)
         {
-            (*p_ss).avg_log[channel_i] = 20 * log10 ((*p_ss).avg_power[channel_i]) / 40 * 100;
+            if (aw_ring_reserve (&(*p_streams[i].p_writer).ring) != NULL)
+            {
+                aw_ring_commit (&(*p_streams[i].p_writer).ring, AW_SLOT_END, 0);
+                sem_post (&(*p_streams[i].p_writer).sem_data);
+                p_streams[i].take_open = 0;
 
-        } else {
+            } else {
 
-            (*p_ss).avg_log[channel_i] = 0;
+                usleep (1000);
+            }
         }
+        free (p_streams[i].p_scratch);
     }
-    return 0;
+    atomic_store_explicit (p_state, AW_STOPPED, memory_order_release);
+    
+    return err;
 }
 
-int aw_cycle (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, FILE** p_p_f, AwComputeStruct* p_ss, aw_record_state_t* p_state)
+int aw_cycle (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, AwWriter* p_writer, AwComputeStruct* p_ss, aw_atomic_state_t* p_state, int wake_fd)
 {
-    int i;
-    int err;    
-    void* p_buffer = malloc (snd_pcm_frames_to_bytes (p_pcm, (*p_hw_params).buffer_size));
-    snd_pcm_sframes_t nframes_or_err;
+    AwStream stream = { p_pcm, p_hw_params, p_writer, p_ss };
 
-    i = 0;
-    
-    while (*p_state == AW_RECORDING || *p_state == AW_MONITORING || *p_state == AW_PAUSED)
-    {
-        if ((nframes_or_err = snd_pcm_readi (p_pcm, p_buffer, (*p_hw_params).buffer_size)) != (*p_hw_params).buffer_size)        
-            if (snd_pcm_recover (p_pcm, nframes_or_err, 0) < 0)
-                return aw_handle_err (snd_strerror (nframes_or_err));
-                
-        if (aw_compute (p_buffer, p_hw_params, p_ss) < 0)
-            return aw_handle_err ("error in computing");
-        
-        if (*p_state == AW_RECORDING)
-        {
-            if (fwrite (p_buffer, (*p_hw_params).samplesize, (*p_hw_params).buffer_size * (*p_hw_params).nchannels, *p_p_f) < 0)
-                return aw_handle_err (strerror (err));
-        }        
-        i++;
-    }
-    free (p_buffer);
-    *p_state = AW_STOPPED;
-    
-    return 0;
+    clock_gettime (CLOCK_REALTIME, &stream.start);
+
+    return aw_streams_cycle (&stream, 1, p_state, wake_fd);
 }
 
-int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, snd_pcm_format_t format, const char* filepath, AwComputeStruct* p_ss, aw_record_state_t* p_state) // see snd_pcm_build_linear_format(int width, int pwidth, int unsignd, int big_endian);
+int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, snd_pcm_format_t format, const char* filepath, AwComputeStruct* p_ss, aw_atomic_state_t* p_state) // see snd_pcm_build_linear_format(int width, int pwidth, int unsignd, int big_endian);
 {
     int err;
     snd_pcm_t* p_pcm;
     AwPcmParams hw_params;
+    AwWriter writer;
 
     hw_params.nchannels = nchannels; 
     hw_params.framerate = framerate; 
     hw_params.format = format; 
+    hw_params.access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+    hw_params.period_time = AW_DEFAULT_PERIOD_TIME;
+    hw_params.period_count = AW_DEFAULT_PERIOD_COUNT;
     
     FILE* p_f;
 
@@ -562,6 +3056,9 @@ int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, s
     
     if ((p_f = fopen (filepath, "w")) == NULL)
         return aw_handle_err (strerror(errno));
+
+    if ((err = aw_writer_start (&writer, &hw_params, AW_DEFAULT_RING_DEPTH, AW_DEFAULT_PREROLL, &p_f)) < 0)
+        return aw_handle_err ("cannot start writer");
     
     if ((err = snd_pcm_prepare (p_pcm)) < 0)
         return aw_handle_err(snd_strerror (err));
@@ -574,8 +3071,10 @@ int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, s
     if ((err = snd_pcm_start (p_pcm)) < 0)
         return aw_handle_err (snd_strerror(err));
     
-    if ((err = aw_cycle (p_pcm, &hw_params, &p_f, p_ss, p_state)) < 0)
+    if ((err = aw_cycle (p_pcm, &hw_params, &writer, p_ss, p_state, -1)) < 0)
         return aw_handle_err ("broken reading cycle");
+
+    aw_writer_stop (&writer);
     
     if ((fclose(p_f)) == EOF)
         return aw_handle_err (strerror(errno));
@@ -597,11 +3096,361 @@ void* aw_thread_func (void* p_thread_struct)
     aw_thread_struct_t thread_struct;
 
     thread_struct = *((aw_thread_struct_t*) p_thread_struct);
+
+    if (thread_struct.p_streams != NULL)
+    {
+        aw_streams_cycle (thread_struct.p_streams, thread_struct.nstreams, thread_struct.p_state, thread_struct.wake_fd);
+        return NULL;
+    }
     
     aw_cycle (thread_struct.p_pcm,
               thread_struct.p_hw_params, 
-              thread_struct.p_p_f, 
+              thread_struct.p_writer, 
               thread_struct.p_ss, 
-              thread_struct.p_state);
+              thread_struct.p_state,
+              thread_struct.wake_fd);
+
+    return NULL;
+}
+
+/*
+ * locks what is mapped now; later mappings too when the memlock limit allows it,
+ * since under a finite limit MCL_FUTURE makes later allocations (thread stacks included) fail.
+ * failures only lose the guarantee.
+*/
+int aw_rt_lock_memory ()
+{
+    struct rlimit limit;
+    int flags = MCL_CURRENT;
+
+    if (getrlimit (RLIMIT_MEMLOCK, &limit) == 0 && (limit.rlim_cur == RLIM_INFINITY || geteuid () == 0))
+        flags |= MCL_FUTURE;
+
+    if (mlockall (flags) < 0)
+    {
+        fprintf (stderr, "rt: cannot lock memory (%s), raise the memlock limit (ulimit -l) to keep pages resident\n", strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* write one byte per page, so the capture thread never takes the first touch fault */
+int aw_prefault (void* p_data, size_t bytes)
+{
+    volatile char* p = (volatile char*) p_data;
+    size_t page = sysconf (_SC_PAGESIZE);
+    size_t i;
+
+    for (i = 0; i < bytes; i += page)
+        p[i] = p[i];
+
+    return 0;
+}
+
+int aw_writer_prefault (AwWriter* p_writer)
+{
+    aw_prefault ((*p_writer).ring.p_data, (size_t) (*p_writer).ring.depth * (*p_writer).ring.slot_bytes);
+    aw_prefault ((*p_writer).preroll.p_data, (size_t) (*p_writer).preroll.nchunks * (*p_writer).preroll.chunk_bytes);
+    aw_prefault ((*p_writer).p_silence, (*p_writer).ring.slot_bytes);
+
+    return 0;
+}
+
+/*
+ * starts aw_thread_func, with SCHED_FIFO and cpu pinning when rt is enabled.
+ * missing permissions or a bad cpu are reported and the thread starts without them.
+*/
+int aw_thread_start (pthread_t* p_thread_id, aw_thread_struct_t* p_thread_struct, AwRtParams* p_rt)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int realtime = 1;
+    int pinned;
+    int err;
+
+    if (((*p_thread_struct).wake_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+        return aw_handle_err (strerror (errno));
+
+    if (p_rt == NULL || !(*p_rt).enabled)
+    {
+        if ((err = pthread_create (p_thread_id, NULL, aw_thread_func, (void*) p_thread_struct)) != 0)
+        {
+            close ((*p_thread_struct).wake_fd);
+            return aw_handle_err (strerror (err));
+        }
+        return 0;
+    }
+
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    param.sched_priority = (*p_rt).priority;
+    pthread_attr_setschedparam (&attr, &param);
+
+    if ((pinned = (*p_rt).cpu >= 0))
+    {
+        CPU_ZERO (&cpus);
+        CPU_SET ((*p_rt).cpu, &cpus);
+        pthread_attr_setaffinity_np (&attr, sizeof cpus, &cpus);
+    }
+
+    /* drop whatever the system refuses, one thing at a time */
+    while ((err = pthread_create (p_thread_id, &attr, aw_thread_func, (void*) p_thread_struct)) != 0)
+    {
+        if (err == EPERM && realtime)
+        {
+            fprintf (stderr, "rt: no permission for SCHED_FIFO priority %d (needs an rtprio limit or CAP_SYS_NICE), capture runs at normal priority\n", (*p_rt).priority);
+            pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+            realtime = 0;
+
+        } else if (err == EINVAL && pinned) {
+
+            fprintf (stderr, "rt: cannot pin capture to cpu %d, running unpinned\n", (*p_rt).cpu);
+            sched_getaffinity (0, sizeof cpus, &cpus);
+            pthread_attr_setaffinity_np (&attr, sizeof cpus, &cpus);
+            pinned = 0;
+
+        } else {
+
+            break;
+        }
+    }
+    pthread_attr_destroy (&attr);
+
+    if (err != 0)
+    {
+        close ((*p_thread_struct).wake_fd);
+        return aw_handle_err (strerror (err));
+    }
+    return 0;
+}
+
+static void aw_deadline (struct timespec* p_deadline, int timeout)
+{
+    clock_gettime (CLOCK_REALTIME, p_deadline);
+    (*p_deadline).tv_sec += timeout / 1000;
+    (*p_deadline).tv_nsec += (timeout % 1000) * 1000000L;
+
+    if ((*p_deadline).tv_nsec >= 1000000000L)
+    {
+        (*p_deadline).tv_sec++;
+        (*p_deadline).tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * stops the capture thread without spinning: the state is set, the eventfd wakes its wait and the thread is joined.
+ * a thread still inside alsa after timeout msec gets its pcm dropped; if even that does not free it,
+ * it is detached and -1 returned, so nothing it uses may be released.
+*/
+int aw_thread_stop (pthread_t thread_id, aw_thread_struct_t* p_thread_struct, int timeout)
+{
+    struct timespec deadline;
+    uint64_t one = 1;
+    int err;
+    int i;
+
+    atomic_store_explicit ((*p_thread_struct).p_state, AW_STOPPING, memory_order_release);
+
+    if (write ((*p_thread_struct).wake_fd, &one, sizeof one) < 0)
+        fprintf (stderr, "cannot wake capture thread: %s\n", strerror (errno));
+
+    aw_deadline (&deadline, timeout);
+
+    if ((err = pthread_timedjoin_np (thread_id, NULL, &deadline)) == ETIMEDOUT)
+    {
+        if ((*p_thread_struct).p_streams == NULL)
+            snd_pcm_drop ((*p_thread_struct).p_pcm);
+
+        for (i = 0; i < (*p_thread_struct).nstreams; i++)
+            snd_pcm_drop ((*p_thread_struct).p_streams[i].p_pcm);
+
+        aw_deadline (&deadline, timeout);
+        err = pthread_timedjoin_np (thread_id, NULL, &deadline);
+    }
+    if (err != 0)
+    {
+        pthread_detach (thread_id);
+        return aw_handle_err ("capture thread does not stop, left running");
+    }
+    close ((*p_thread_struct).wake_fd);
+    (*p_thread_struct).wake_fd = -1;
+
+    return 0;
+}
+
+/*
+ * latency auto-tuning: candidate configurations go from the smallest buffer up,
+ * each one monitored through the real capture thread while every cpu is kept busy;
+ * the first without xruns stays set on the pcm.
+*/
+
+static atomic_int aw_autotune_loading;
+
+static void* aw_autotune_load_func (void* p_arg)
+{
+    unsigned char value = 0;
+    char* p_data = malloc (AW_ARENA_CHUNK);
+
+    if (p_data == NULL)
+        return NULL;
+
+    while (atomic_load_explicit (&aw_autotune_loading, memory_order_relaxed))
+        memset (p_data, value++, AW_ARENA_CHUNK);
+
+    free (p_data);
+
+    return NULL;
+}
+
+/* what a test capture thread uses, on the heap so that a thread that does not stop can keep it */
+typedef struct AwAutotuneRun {
+
+    AwPcmParams params;
+    AwWriter writer;
+    AwComputeStruct ss;
+    aw_thread_struct_t thread_struct;
+    aw_atomic_state_t state;
+    FILE* p_f;
+
+} AwAutotuneRun;
+
+/*
+ * returns the xruns seen in AW_AUTOTUNE_TEST_TIME, -1 if the configuration does not run at all,
+ * -ETIMEDOUT if its capture thread did not stop: the run and the pcm are left to it
+*/
+static int aw_autotune_try (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, AwRtParams* p_rt)
+{
+    AwAutotuneRun* p_run;
+    pthread_t thread_id;
+    int xruns = -1;
+
+    if (aw_set_params (p_pcm, p_hw_params) < 0)
+        return -1;
+
+    if ((p_run = calloc (1, sizeof (AwAutotuneRun))) == NULL)
+        return aw_handle_err (strerror (errno));
+
+    (*p_run).params = *p_hw_params;
+    (*p_run).state = AW_MONITORING;
+
+    if (aw_writer_start (&(*p_run).writer, &(*p_run).params, AW_DEFAULT_RING_DEPTH, 0, &(*p_run).p_f) < 0)
+    {
+        free (p_run);
+        return -1;
+    }
+
+    aw_build_compute_struct ((*p_run).params, &(*p_run).ss);
+
+    (*p_run).thread_struct.p_pcm = p_pcm;
+    (*p_run).thread_struct.p_hw_params = &(*p_run).params;
+    (*p_run).thread_struct.p_writer = &(*p_run).writer;
+    (*p_run).thread_struct.p_ss = &(*p_run).ss;
+    (*p_run).thread_struct.p_state = &(*p_run).state;
+    (*p_run).thread_struct.p_streams = NULL;
+    (*p_run).thread_struct.nstreams = 0;
+
+    if (snd_pcm_prepare (p_pcm) == 0 && snd_pcm_start (p_pcm) == 0 &&
+        aw_thread_start (&thread_id, &(*p_run).thread_struct, p_rt) == 0)
+    {
+        usleep (AW_AUTOTUNE_TEST_TIME);
+
+        // nothing the thread uses may be released under it
+        if (aw_thread_stop (thread_id, &(*p_run).thread_struct, AW_THREAD_STOP_TIMEOUT) < 0)
+            return -ETIMEDOUT;
+
+        xruns = (*p_run).ss.xruns;
+    }
+    snd_pcm_drop (p_pcm);
+
+    aw_free_compute_struct (&(*p_run).ss);
+    aw_writer_stop (&(*p_run).writer);
+    free (p_run);
+
+    return xruns;
 }
 
+int aw_autotune (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, AwPcm* p_aw_pcm, AwRtParams* p_rt)
+{
+    const AwLatencyProfile* p_widest = &AW_LATENCY_PROFILES[AW_LATENCY_LOW_WAKEUP];
+    snd_pcm_uframes_t period = AW_AUTOTUNE_MIN_PERIOD;
+    snd_pcm_uframes_t period_max = 0;
+    snd_pcm_uframes_t buffer_max = 0;
+    unsigned int count;
+    pthread_t* p_load;
+    long nload;
+    long i;
+    int xruns;
+    int tuned = 0;
+
+    /* device limits at this rate, as probed by aw_get_pcm_devices */
+    for (i = 0; p_aw_pcm != NULL && i < AW_MAX_FRAMERATES_LENGTH && (*p_aw_pcm).framerates[i] != -1; i++)
+    {
+        if ((*p_aw_pcm).framerates[i] == (*p_hw_params).framerate)
+        {
+            if ((*p_aw_pcm).period_size_min[i] > period)
+                period = (*p_aw_pcm).period_size_min[i];
+            period_max = (*p_aw_pcm).period_size_max[i];
+            buffer_max = (*p_aw_pcm).buffer_size_max[i];
+        }
+    }
+
+    if ((nload = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+        nload = 1;
+
+    if ((p_load = calloc (nload, sizeof (pthread_t))) == NULL)
+        return aw_handle_err (strerror (errno));
+
+    atomic_store (&aw_autotune_loading, 1);
+
+    for (i = 0; i < nload; i++)
+        if (pthread_create (&p_load[i], NULL, aw_autotune_load_func, NULL) != 0)
+            break;
+    nload = i;
+
+    /* buffers of 2, 3, 4, 6, 8, 12 ... smallest periods, up to the low-wakeup period */
+    for (xruns = -1; !tuned && xruns != -ETIMEDOUT && period * 1000000 / (*p_hw_params).framerate <= (*p_widest).period_time; period *= 2)
+    {
+        if (period_max > 0 && period > period_max)
+            break;
+
+        for (count = 2; !tuned && count <= 3; count++)
+        {
+            if (buffer_max > 0 && period * count > buffer_max)
+                break;
+
+            (*p_hw_params).period_time = (period * 1000000 + (*p_hw_params).framerate - 1) / (*p_hw_params).framerate;
+            (*p_hw_params).period_count = count;
+
+            if ((xruns = aw_autotune_try (p_pcm, p_hw_params, p_rt)) == -ETIMEDOUT)
+                break;
+
+            printf ("autotune: period %lu frames x %u, %d xruns\n", (*p_hw_params).period_size, count, xruns);
+
+            tuned = xruns == 0;
+        }
+    }
+
+    atomic_store (&aw_autotune_loading, 0);
+
+    for (i = 0; i < nload; i++)
+        pthread_join (p_load[i], NULL);
+    free (p_load);
+
+    if (tuned)
+        return 0;
+
+    if (xruns == -ETIMEDOUT)
+    {
+        fprintf (stderr, "autotune: a capture thread did not stop, the device is left to it\n");
+        return -ETIMEDOUT;
+    }
+
+    fprintf (stderr, "autotune: no clean configuration, using the %s profile\n", (*p_widest).name);
+
+    (*p_hw_params).period_time = (*p_widest).period_time;
+    (*p_hw_params).period_count = (*p_widest).period_count;
+
+    return aw_set_params (p_pcm, p_hw_params);
+}
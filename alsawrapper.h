@@ -27,7 +27,11 @@
 #include <unistd.h>
 #include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
+#include <lame/lame.h>
+#include <FLAC/stream_encoder.h>
 
 
 int aw_handle_err (const char* msg);
@@ -44,6 +48,27 @@ int32_t aw_parser_S24_3LE (char* p_sample);
 int32_t aw_parser_S32_LE (char* p_sample);
 
 
+/*============================================================================
+                metering kernels
+============================================================================*/
+
+
+#define AW_KERNEL_BLOCK 4096 // frames per kernel call
+#define AW_UNPACK_CHUNK 1024 // samples unpacked at once by packed 24 bit kernels
+#define AW_S32_SUMSQ_SHIFT 8 // S32 squares are taken on 24 bit magnitudes
+
+typedef enum {
+
+    AW_ISA_SCALAR = 0,
+    AW_ISA_SSE2 = 1,
+    AW_ISA_SSSE3 = 2,
+    AW_ISA_AVX2 = 3
+
+} aw_isa_t;
+
+aw_isa_t aw_detect_isa ();
+
+
 /*============================================================================
                 cards, pcms, confs
 ============================================================================*/
@@ -54,7 +79,8 @@ int32_t aw_parser_S32_LE (char* p_sample);
 #define AW_DEFAULT_FORMAT SND_PCM_FORMAT_S16_LE
 #define AW_DEFAULT_PERIOD_TIME 10000 // usec
 #define AW_DEFAULT_PERIOD_COUNT 4 // buffer/period ratio
-#define AW_STAT_TIME 250000 // usec
+#define AW_METER_WINDOW 250 // msec averaged by the meters
+#define AW_METER_BIN 5 // msec, the window slides by one bin at a time
 #define AW_MAX_PCMS_LENGTH 128
 #define AW_MAX_NCHANNELS_LENGTH 32
 #define AW_MAX_FRAMERATES_LENGTH 32
@@ -68,11 +94,13 @@ typedef struct AwPcm {
     int8_t nchannels[AW_MAX_NCHANNELS_LENGTH];
     int32_t framerates[AW_MAX_FRAMERATES_LENGTH];
     snd_pcm_format_t formats[AW_MAX_FORMATS_LENGTH];
-    snd_pcm_uframes_t period_size_min[32];
-    snd_pcm_uframes_t period_size_max[32];
-    snd_pcm_uframes_t buffer_size_min[32];
-    snd_pcm_uframes_t buffer_size_max[32];
+    snd_pcm_uframes_t period_size_min[AW_MAX_FRAMERATES_LENGTH]; // per framerate, same index
+    snd_pcm_uframes_t period_size_max[AW_MAX_FRAMERATES_LENGTH];
+    snd_pcm_uframes_t buffer_size_min[AW_MAX_FRAMERATES_LENGTH];
+    snd_pcm_uframes_t buffer_size_max[AW_MAX_FRAMERATES_LENGTH];
     int has_plughw;
+    int card;
+    int probed; // capabilities filled, see aw_list_card
     char name[32];
     char cardname[128];
     char cardlongname[256];
@@ -83,9 +111,13 @@ typedef struct AwPcm {
 typedef struct AwPcmParams {
     
     int32_t (*p_parser) (char*);
+    void (*p_kernel) (char*, snd_pcm_uframes_t, uint8_t, uint32_t*, uint64_t*);
+    void (*p_unpack) (char*, int32_t*, size_t);
+    double power_scale;
     uint8_t nchannels;
     uint32_t framerate;
     snd_pcm_format_t format;
+    snd_pcm_access_t access;
     int is_signed;
     int is_little_endian;
     uint8_t nominal_bits;
@@ -95,6 +127,8 @@ typedef struct AwPcmParams {
     uint8_t framesize;
     uint32_t byterate;
     uint32_t max; 
+    unsigned int period_time; // usec asked, 0 for AW_DEFAULT_PERIOD_TIME; granted once set
+    unsigned int period_count; // periods per buffer, 0 for AW_DEFAULT_PERIOD_COUNT
     snd_pcm_uframes_t period_size;
     snd_pcm_uframes_t buffer_size;
     char description[512];
@@ -183,8 +217,47 @@ static const snd_pcm_format_t AW_POPULAR_FORMATS[AW_POPULAR_FORMATS_LENGTH] = {
     // SND_PCM_FORMAT_U20
 };
 
+#define AW_MAX_CARDS 32 // as the kernel
+#define AW_CACHE_MAGIC 0x43505741 // "AWPC"
+#define AW_CACHE_VERSION 2
+
+/* what identifies a card across runs, the capability cache key */
+typedef struct AwCard {
+
+    int index;
+    char id[32];
+    char driver[32];
+    char longname[256];
+
+} AwCard;
+
+int aw_list_card (int card_i, AwPcm aw_pcms[], uint8_t* p_aw_pcms_length);
+
+int aw_probe_pcm (AwPcm* p_aw_pcm);
+
+int aw_probe_card (int card_i, AwPcm aw_pcms[], uint8_t* p_aw_pcms_length);
+
 int aw_get_pcm_devices (AwPcm aw_pcms[], uint8_t* p_aw_pcms_length);
 
+int aw_get_card (int card_i, AwCard* p_card);
+
+int aw_save_pcm_devices_cache (AwPcm aw_pcms[], uint8_t aw_pcms_length, const char* cache_path);
+
+int aw_get_pcm_devices_cached (AwPcm aw_pcms[], uint8_t* p_aw_pcms_length, const char* cache_path, int lazy);
+
+#define AW_HOTPLUG_DIR "/dev/snd"
+
+typedef struct AwHotplugEvent {
+
+    int card;
+    int added; // 0 when removed
+
+} AwHotplugEvent;
+
+int aw_hotplug_open ();
+
+int aw_hotplug_wait (int fd, AwHotplugEvent events[], int max_events);
+
 int aw_print_pcms (AwPcm aw_pcms[], uint8_t aw_pcms_length);
 
 int aw_print_pcm (AwPcm* p_aw_pcm);
@@ -195,11 +268,237 @@ int aw_print_pcm (AwPcm* p_aw_pcm);
 ============================================================================*/
 
 
+typedef enum {
+
+    AW_LATENCY_LOW = 0,
+    AW_LATENCY_BALANCED = 1,
+    AW_LATENCY_LOW_WAKEUP = 2,
+    AW_LATENCY_AUTO = 3 // smallest buffer that survives aw_autotune
+
+} aw_latency_t;
+
+typedef struct AwLatencyProfile {
+
+    const char* name;
+    unsigned int period_time; // usec
+    unsigned int period_count;
+
+} AwLatencyProfile;
+
+#define AW_LATENCY_PROFILES_LENGTH 3
+
+static const AwLatencyProfile AW_LATENCY_PROFILES[AW_LATENCY_PROFILES_LENGTH] = {
+
+    { "low", 2500, 3 },
+    { "balanced", AW_DEFAULT_PERIOD_TIME, AW_DEFAULT_PERIOD_COUNT },
+    { "low-wakeup", 50000, 4 }
+};
+
 int aw_set_params (snd_pcm_t* p_pcm, AwPcmParams* p_params);
 
+int aw_select_kernel (AwPcmParams* p_params);
+
+int aw_select_kernel_isa (AwPcmParams* p_params, aw_isa_t isa);
+
 int aw_print_params (AwPcmParams hw_params);
 
 
+/*============================================================================
+                wav files
+============================================================================*/
+
+
+#define AW_WAV_HEADER_MAX 128 // bytes
+#define AW_WAV_DS64_SIZE 28 // bytes
+
+#define AW_WAVE_FORMAT_PCM 0x0001
+#define AW_WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+#define AW_SPEAKER_FRONT_LEFT 0x1
+#define AW_SPEAKER_FRONT_RIGHT 0x2
+#define AW_SPEAKER_FRONT_CENTER 0x4
+#define AW_SPEAKER_BACK_LEFT 0x10
+#define AW_SPEAKER_BACK_RIGHT 0x20
+
+int aw_wav_build_header (unsigned char* p_header, AwPcmParams* p_params, uint64_t data_size, int rf64);
+
+int aw_wav_needs_rf64 (AwPcmParams* p_params, uint64_t data_size);
+
+int aw_wav_write_header (FILE* p_f, AwPcmParams* p_params);
+
+int aw_wav_patch_header (FILE* p_f, AwPcmParams* p_params, uint64_t data_size, int rf64);
+
+int aw_wav_finalize (FILE* p_f, AwPcmParams* p_params, uint64_t data_size);
+
+
+/*============================================================================
+                memory arena
+============================================================================*/
+
+
+#define AW_ARENA_CHUNK 4194304 // bytes per block, a multiple of the page size
+#define AW_ARENA_WRITEV_BATCH 16 // blocks per writev when saving, progress and cancel are checked between batches
+
+/* take storage in large anonymous blocks behind a FILE*, moved to a spill file past the budget */
+typedef struct AwArena {
+
+    char** p_p_chunks;
+    size_t nchunks;
+    size_t max_chunks;
+    off_t size;
+    off_t pos;
+    size_t budget;
+    int lock;
+    int spilled;
+    size_t nspilled; // leading blocks already moved to the spill file and unmapped
+    int fd; // spill file while open
+    char spill_path[512];
+
+} AwArena;
+
+FILE* aw_arena_open (AwArena* p_arena, size_t budget, int lock, const char* spill_path);
+
+int aw_arena_spilled (AwArena* p_arena);
+
+int aw_arena_save (AwArena* p_arena, const char* path, atomic_int* p_progress, atomic_int* p_cancel);
+
+int aw_arena_free (AwArena* p_arena);
+
+
+/*============================================================================
+                period ring and disk writer
+============================================================================*/
+
+
+#define AW_DEFAULT_RING_DEPTH 256 // periods
+#define AW_DEFAULT_PREROLL 0 // sec kept while monitoring
+#define AW_WRITER_END_TIMEOUT 2 // sec
+
+typedef enum {
+
+    AW_SLOT_DATA = 0,
+    AW_SLOT_END = 1,
+    AW_SLOT_PREROLL = 2,
+    AW_SLOT_GAP = 3 // nframes of silence standing in for lost audio
+
+} aw_slot_kind_t;
+
+/* lock-free single producer (capture) single consumer (writer) ring of pre-allocated period buffers */
+typedef struct AwRing {
+
+    char* p_data;
+    snd_pcm_uframes_t* nframes;
+    aw_slot_kind_t* kinds;
+    uint32_t depth;
+    size_t slot_bytes;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint high_water;
+    atomic_uint overflows;
+
+} AwRing;
+
+int aw_ring_init (AwRing* p_ring, uint32_t depth, size_t slot_bytes);
+
+int aw_ring_free (AwRing* p_ring);
+
+char* aw_ring_reserve (AwRing* p_ring);
+
+int aw_ring_commit (AwRing* p_ring, aw_slot_kind_t kind, snd_pcm_uframes_t nframes);
+
+char* aw_ring_peek (AwRing* p_ring, aw_slot_kind_t* p_kind, snd_pcm_uframes_t* p_nframes);
+
+int aw_ring_release (AwRing* p_ring);
+
+/* circular history of whole periods filled while monitoring, handed to the writer ahead of the next take */
+typedef struct AwPreroll {
+
+    char* p_data;
+    uint32_t nchunks;
+    size_t chunk_bytes;
+    uint32_t next;
+    uint32_t filled;
+    atomic_int busy; // set while the writer drains it
+
+} AwPreroll;
+
+int aw_preroll_init (AwPreroll* p_preroll, uint32_t nchunks, size_t chunk_bytes);
+
+int aw_preroll_free (AwPreroll* p_preroll);
+
+char* aw_preroll_chunk (AwPreroll* p_preroll);
+
+int aw_preroll_advance (AwPreroll* p_preroll);
+
+typedef enum {
+
+    AW_SAVE_WAV = 0,
+    AW_SAVE_MP3 = 1,
+    AW_SAVE_FLAC = 2
+
+} aw_save_format_t;
+
+#define AW_MP3_VBR_QUALITY 2 // 0 best .. 9 smallest
+#define AW_FLAC_COMPRESSION_LEVEL 5 // 0 fastest .. 8 smallest
+#define AW_FLAC_MAX_CHANNELS 8 // format limit
+#define AW_FLAC_DEFAULT_THREADS 4 // frames encoded in parallel
+
+struct AwWriter;
+
+/* per take sink: begin opens the stream, write takes a slot of interleaved frames, end finalizes */
+typedef struct AwEncoder {
+
+    int (*p_begin) (struct AwWriter* p_writer);
+    int (*p_write) (struct AwWriter* p_writer, char* p_buffer, snd_pcm_uframes_t nframes);
+    int (*p_end) (struct AwWriter* p_writer);
+
+} AwEncoder;
+
+/* disk writer thread fed by the ring, encodes each take in the format set before it starts */
+typedef struct AwWriter {
+
+    AwRing ring;
+    AwPreroll preroll;
+    char* p_silence;
+    FILE** p_p_f;
+    AwPcmParams* p_params;
+    aw_save_format_t format;
+    const AwEncoder* p_encoder;
+    uint64_t data_size;
+    int rf64;
+    lame_global_flags* p_lame;
+    int32_t* p_samples;
+    unsigned char* p_mp3_buffer;
+    int mp3_buffer_size;
+    FLAC__StreamEncoder* p_flac;
+    uint32_t flac_threads;
+    uint64_t rotate_frames; // 0 for no rotation by duration
+    uint64_t rotate_bytes; // 0 for no rotation by size
+    char rotate_prefix[512]; // segments are <prefix>-NNN.<ext>
+    uint32_t segment;
+    uint64_t segment_frames;
+    FILE* p_next_f;
+    int in_take;
+    sem_t sem_data;
+    sem_t sem_end;
+    atomic_int running;
+    pthread_t thread_id;
+
+} AwWriter;
+
+const char* aw_save_extension (aw_save_format_t format);
+
+int aw_segment_path (char* path, size_t size, const char* prefix, uint32_t segment, aw_save_format_t format);
+
+int aw_writer_start (AwWriter* p_writer, AwPcmParams* p_hw_params, uint32_t depth, double preroll, FILE** p_p_f);
+
+int aw_writer_wait_end (AwWriter* p_writer);
+
+int aw_writer_stop (AwWriter* p_writer);
+
+void* aw_writer_thread_func (void* p_writer);
+
+
 /*============================================================================
                 record cycle and compute
 ============================================================================*/
@@ -216,16 +515,39 @@ typedef enum {
 
 } aw_record_state_t; 
 
+typedef _Atomic aw_record_state_t aw_atomic_state_t; // written by the gui, read by the capture thread
+
+#define AW_XRUN_LOG_LENGTH 64 // most recent xruns kept
+
+typedef struct AwXrun {
+
+    struct timespec when; // wall clock at recovery
+    snd_pcm_uframes_t lost_frames;
+
+} AwXrun;
+
 typedef struct AwComputeStruct {
 
-    float* avgs_queue;
-    uint16_t avgs_queue_length;
-    uint16_t avgs_queue_start;
-    uint16_t avgs_queue_end;
+    double* bins; // mean square of the last meter_nbins bins, per channel
+    uint32_t meter_nbins;
+    uint32_t meter_bin; // oldest bin, overwritten next
+    snd_pcm_uframes_t bin_frames;
+    double* window_power; // sliding sum of the bins, per channel
     float* avg_power; 
     float* avg_log;
     float* max;
     int* clip;
+    double* sum_power;
+    snd_pcm_uframes_t sum_nframes;
+    uint32_t* peaks;
+    uint64_t* sumsqs;
+    uint32_t ring_high_water;
+    uint32_t ring_overflows;
+    uint32_t xruns;
+    uint32_t short_reads;
+    uint64_t lost_frames;
+    AwXrun xrun_log[AW_XRUN_LOG_LENGTH]; // entry xruns % AW_XRUN_LOG_LENGTH is the next one
+    struct timespec take_start; // wall clock of the first frame of the last take, preroll included
 
 } AwComputeStruct;
 
@@ -233,13 +555,48 @@ int aw_build_compute_struct (AwPcmParams hw_params, AwComputeStruct* p_ss);
 
 int aw_free_compute_struct (AwComputeStruct* p_ss);
 
-float aw_queue_cycle (AwComputeStruct* p_ss, int channel_i, float entry);
+int aw_compute (void* p_buffer, snd_pcm_uframes_t nframes, AwPcmParams* p_params, AwComputeStruct* p_ss);
+
+int aw_compute_flush (AwPcmParams* p_params, AwComputeStruct* p_ss);
 
-int aw_compute (void* p_buffer, AwPcmParams* p_params, AwComputeStruct* p_ss);
+#define AW_MAX_POLL_FDS 16 // descriptors of one pcm
 
-int aw_cycle (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, FILE** p_p_f, AwComputeStruct* p_ss, aw_record_state_t* p_state);
+int aw_pcm_wait (snd_pcm_t* p_pcm, int wake_fd, int timeout);
+
+snd_pcm_sframes_t aw_mmap_read (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, char* p_dest, snd_pcm_uframes_t* p_nframes, AwComputeStruct* p_ss, int wake_fd);
+
+int aw_account_xrun (AwComputeStruct* p_ss, snd_pcm_uframes_t lost_frames);
+
+int aw_cycle (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, AwWriter* p_writer, AwComputeStruct* p_ss, aw_atomic_state_t* p_state, int wake_fd);
+
+#define AW_MAX_STREAMS 4 // pcms captured in one session
+
+/* one pcm of a capture session, with its own writer and meters */
+typedef struct AwStream {
+
+    snd_pcm_t* p_pcm;
+    AwPcmParams* p_hw_params;
+    AwWriter* p_writer;
+    AwComputeStruct* p_ss;
+    struct timespec start; // wall clock of the first frame, see aw_streams_start
+    int linked; // in the snd_pcm_link group of stream 0, restarted along with it
 
-int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, snd_pcm_format_t format, const char* filepath, AwComputeStruct* p_ss, aw_record_state_t* p_state);
+    /* kept by aw_streams_cycle */
+    char* p_scratch;
+    int take_open;
+    snd_pcm_uframes_t gap;
+    uint64_t position; // frames since start, lost ones included
+    int xrun; // the read error to recover from, see aw_streams_recover
+    snd_pcm_sframes_t stop_avail; // captured and unread when the stream stopped, dropped by the recovery
+    struct timespec stop_time;
+
+} AwStream;
+
+int aw_streams_start (AwStream* p_streams, int nstreams);
+
+int aw_streams_cycle (AwStream* p_streams, int nstreams, aw_atomic_state_t* p_state, int wake_fd);
+
+int aw_record (const char* device_name, uint8_t nchannels, uint32_t framerate, snd_pcm_format_t format, const char* filepath, AwComputeStruct* p_ss, aw_atomic_state_t* p_state);
 
 
 /*============================================================================
@@ -251,12 +608,44 @@ typedef struct aw_thread_struct_t
 {
     snd_pcm_t* p_pcm;
     AwPcmParams* p_hw_params;
-    FILE** p_p_f;
+    AwWriter* p_writer;
     AwComputeStruct* p_ss;
-    aw_record_state_t* p_state; 
+    aw_atomic_state_t* p_state; 
+    int wake_fd; // eventfd, see aw_thread_stop
+    AwStream* p_streams; // when set, all of them are captured and the single pcm fields are unused
+    int nstreams;
     
 } aw_thread_struct_t;
 
 void* aw_thread_func (void* p_thread_struct);
 
+#define AW_RT_DEFAULT_PRIORITY 70 // SCHED_FIFO, 1 .. 99
+
+/* opt-in real time capture thread */
+typedef struct AwRtParams {
+
+    int enabled;
+    int priority;
+    int cpu; // -1 for no pinning
+
+} AwRtParams;
+
+int aw_rt_lock_memory ();
+
+int aw_prefault (void* p_data, size_t bytes);
+
+int aw_writer_prefault (AwWriter* p_writer);
+
+int aw_thread_start (pthread_t* p_thread_id, aw_thread_struct_t* p_thread_struct, AwRtParams* p_rt);
+
+#define AW_THREAD_STOP_TIMEOUT 2000 // msec
+
+int aw_thread_stop (pthread_t thread_id, aw_thread_struct_t* p_thread_struct, int timeout);
+
+#define AW_AUTOTUNE_TEST_TIME 1000000 // usec of capture per candidate
+#define AW_AUTOTUNE_MIN_PERIOD 32 // frames, first candidate when the device allows less
+
+// -ETIMEDOUT: a test capture thread did not stop, it still uses the pcm, which must not be closed
+int aw_autotune (snd_pcm_t* p_pcm, AwPcmParams* p_hw_params, AwPcm* p_aw_pcm, AwRtParams* p_rt);
+
 #endif  // ALSAWRAPPER_H_
\ No newline at end of file
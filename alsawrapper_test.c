@@ -0,0 +1,169 @@
+/*
+ * ALSA facilities, metering kernels check
+ *
+ * Copyright (c) 2021 Fabio Michelini (github)
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * compile with: gcc -o alsawrapper_test alsawrapper_test.c alsawrapper.c -lasound -lmp3lame -lFLAC -lpthread -lm
+ * every kernel the cpu runs is compared with the scalar one, mismatches are counted in the summary and fail the exit status
+*/
+
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "string.h"
+#include "math.h"
+
+#include "alsawrapper.h"
+
+#define MAX_TEST_CHANNELS 33
+#define MAX_TEST_FRAMES 4096
+
+typedef enum {
+
+    FILL_RANDOM = 0,
+    FILL_MIN, // INT_MIN of the format, the one without a positive counterpart
+    FILL_MAX,
+    FILL_ZERO,
+    FILL_ALTERNATE, // full scale square wave
+    FILL_MODES
+
+} fill_mode_t;
+
+static const snd_pcm_format_t FORMATS[] = { SND_PCM_FORMAT_S8, SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE };
+
+// odd lengths leave tails after every vector width
+static const snd_pcm_uframes_t LENGTHS[] = { 1, 3, 7, 15, 17, 31, 33, 63, 65, 1023, MAX_TEST_FRAMES };
+
+static const char* ISA_NAMES[] = { "scalar", "sse2", "ssse3", "avx2" };
+
+static int64_t test_sample (fill_mode_t mode, int bits, size_t i)
+{
+    int64_t v = (int64_t) (((uint64_t) rand () << 33) ^ ((uint64_t) rand () << 10) ^ rand ());
+
+    switch (mode)
+    {
+        case FILL_MIN: return -(1LL << (bits - 1));
+        case FILL_MAX: return (1LL << (bits - 1)) - 1;
+        case FILL_ZERO: return 0;
+        case FILL_ALTERNATE: return (i & 1) ? -(1LL << (bits - 1)) : (1LL << (bits - 1)) - 1;
+        default: return v >> (64 - bits);
+    }
+}
+
+static void test_fill (char* p_buffer, AwPcmParams* p_params, size_t nsamples, fill_mode_t mode)
+{
+    char* p;
+    int64_t v;
+    uint32_t raw;
+    size_t i;
+
+    for (i = 0; i < nsamples; i++)
+    {
+        p = p_buffer + i * (*p_params).samplesize;
+        v = test_sample (mode, (*p_params).nominal_bits, i);
+        raw = (uint32_t) v;
+
+        switch ((*p_params).format)
+        {
+            case SND_PCM_FORMAT_S8: *(int8_t*) p = v; break;
+            case SND_PCM_FORMAT_S16_LE: *(int16_t*) p = v; break;
+            case SND_PCM_FORMAT_S24_3LE: p[0] = v; p[1] = v >> 8; p[2] = v >> 16; break;
+
+            // S24_LE pad byte is not always clean, the kernels must ignore it
+            case SND_PCM_FORMAT_S24_LE: *(uint32_t*) p = (raw & 0xffffff) | ((uint32_t) (rand () & 0xff) << 24); break;
+            default: *(uint32_t*) p = raw; break;
+        }
+    }
+}
+
+static int test_case (snd_pcm_format_t format, uint8_t nchannels, snd_pcm_uframes_t nframes, fill_mode_t mode, aw_isa_t max_isa)
+{
+    AwPcmParams params = { 0 };
+    uint32_t peaks[AW_ISA_AVX2 + 1][MAX_TEST_CHANNELS];
+    uint64_t sumsqs[AW_ISA_AVX2 + 1][MAX_TEST_CHANNELS];
+    char* p_buffer;
+    int fails = 0;
+    int isa;
+    int i;
+
+    params.format = format;
+    params.nchannels = nchannels;
+    params.nominal_bits = snd_pcm_format_width (format);
+    params.samplesize = snd_pcm_format_physical_width (format) / 8;
+    params.framesize = params.samplesize * nchannels;
+    params.max = pow (2, params.nominal_bits) / 2;
+
+    if ((p_buffer = malloc (nframes * params.framesize)) == NULL)
+        return 1;
+
+    test_fill (p_buffer, &params, (size_t) nframes * nchannels, mode);
+
+    for (isa = AW_ISA_SCALAR; isa <= max_isa; isa++)
+    {
+        memset (peaks[isa], 0, sizeof peaks[isa]);
+        memset (sumsqs[isa], 0, sizeof sumsqs[isa]);
+
+        aw_select_kernel_isa (&params, isa);
+        (*params.p_kernel) (p_buffer, nframes, nchannels, peaks[isa], sumsqs[isa]);
+    }
+
+    for (isa = AW_ISA_SSE2; isa <= max_isa; isa++)
+    {
+        for (i = 0; i < nchannels; i++)
+        {
+            if (peaks[isa][i] != peaks[AW_ISA_SCALAR][i] || sumsqs[isa][i] != sumsqs[AW_ISA_SCALAR][i])
+            {
+                printf ("%s: %s %d channels %lu frames fill %d, channel %d peak %u/%u sumsq %lu/%lu\n", ISA_NAMES[isa], snd_pcm_format_name (format),
+                        nchannels, nframes, mode, i, peaks[isa][i], peaks[AW_ISA_SCALAR][i], sumsqs[isa][i], sumsqs[AW_ISA_SCALAR][i]);
+                fails++;
+                break;
+            }
+        }
+    }
+    free (p_buffer);
+
+    return fails;
+}
+
+int main (int argc, char** argv)
+{
+    aw_isa_t max_isa = aw_detect_isa ();
+    int ncases = 0;
+    int fails = 0;
+    size_t f;
+    size_t l;
+    int nchannels;
+    int mode;
+
+    srand (2);
+
+    for (f = 0; f < sizeof FORMATS / sizeof FORMATS[0]; f++)
+    {
+        for (nchannels = 1; nchannels <= MAX_TEST_CHANNELS; nchannels++)
+        {
+            for (l = 0; l < sizeof LENGTHS / sizeof LENGTHS[0]; l++)
+            {
+                for (mode = 0; mode < FILL_MODES; mode++)
+                {
+                    fails += test_case (FORMATS[f], nchannels, LENGTHS[l], mode, max_isa);
+                    ncases++;
+                }
+            }
+        }
+    }
+    printf ("%d cases up to %s, %d mismatches\n", ncases, ISA_NAMES[max_isa], fails);
+
+    return fails == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}